@@ -1,44 +1,30 @@
 /* Atmel AVR programmer
  * Copyright (C)2004-2010 Berke Durak
- * Released in the public domain. */
+ * Released in the public domain.
+ *
+ * Command-line front end to libavrprog. */
 
 #define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/io.h>
 #include <time.h>
-#include <comedilib.h>
-#include <unistd.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
 
-#define DIO0SUBDEV 2
+#include "libavrprog.h"
 
-enum
-{
-  AVR_MOSI_BIT         = 0,
-  AVR_SCLK_BIT         = 1,
-  AVR_RST_BIT          = 2,
-  AVR_FIRST_OUTPUT_BIT = AVR_MOSI_BIT,
-  AVR_LAST_OUTPUT_BIT  = AVR_RST_BIT,
-
-  AVR_MISO_BIT         = 3,
-  AVR_FIRST_INPUT_BIT  = AVR_MISO_BIT,
-  AVR_LAST_INPUT_BIT   = AVR_MISO_BIT
-};
-
-#define AVR_MOSI     (1 << AVR_MOSI_BIT)
-#define AVR_SCLK     (1 << AVR_SCLK_BIT)
-#define AVR_RST      (1 << AVR_RST_BIT)
-#define AVR_OUTBITS  (AVR_MOSI|AVR_SCLK|AVR_RST)
-#define AVR_MISO     (1 << AVR_MISO_BIT)
-#define AVR_INBITS   (AVR_MISO)
-
-static comedi_t *dev;
+#define DIO0DEVICE "/dev/comedi0"
+#define DIO0SUBDEV 2
+#define JOURNAL_FILE "avrprogni.journal"
 
+static avrprog_t *ap;
 bool opt_slow = false;
+bool opt_frames = false;
+struct avrprog_profile profile;
+bool have_profile = false;
+
+static const char *transport_names[] = { "per-bit", "batched", "streamed" };
 
 static inline void udelay(int t_us)
 {
@@ -50,45 +36,42 @@ static inline void udelay(int t_us)
   nanosleep(&ts, NULL);
 }
 
-static inline void ndelay(int ns)
+static void message(void *user, enum avrprog_level level, const char *msg)
 {
-  struct timespec ts;
-
-  ts.tv_sec = 0;
-  ts.tv_nsec = ns;
-  nanosleep(&ts, NULL);
+  if(level == AVRPROG_ERROR) fflush(stdout);
+  fputs(msg, level == AVRPROG_ERROR ? stderr : stdout);
 }
 
-static inline void retard(void)
+static void progress(void *user, enum avrprog_phase phase, int done, int total)
 {
-  ndelay(1);
+  switch(phase) {
+    case AVRPROG_PHASE_PROGRAM:
+      printf("\rProgramming 0x%04x/0x%04x", done, total);
+      break;
+    case AVRPROG_PHASE_STREAM:
+      printf("\rSending 0x%04x/0x%04x", done, total);
+      break;
+    default:
+      return;
+  }
+  if(done == total) printf("\n");
+  fflush(stdout);
 }
 
-void tx(unsigned char x0)
+static bool rx_miso(void)
 {
-  unsigned int x;
-
-  x = x0;
-  comedi_dio_bitfield2(dev, DIO0SUBDEV, AVR_OUTBITS, &x, AVR_FIRST_OUTPUT_BIT);
-  /*printf(">> 0x%02x\n", x);*/
-}
+  bool c;
 
-bool rx_miso(void)
-{
-  unsigned int x;
-  if(comedi_dio_read(dev, DIO0SUBDEV, AVR_MISO_BIT, &x) < 0)
-  {
+  if(avrprog_read_miso(ap, &c)) {
     printf("Bit read error\n");
     abort();
   }
-  /*printf("<< %u\n", x);*/
-  return x == 1;
+  return c;
 }
 
 void monitor(void)
 {
   unsigned char c0,c1;
-  //outb(0x80,LP);
   c0 = 0;
   c1 = 0;
   for(;;) {
@@ -110,10 +93,9 @@ void capture(char *fn)
   f = fopen(fn, "wb");
   if(!f) {
     fprintf(stderr, "Can't open file.\n");
-    return;
+    exit(EXIT_FAILURE);
   }
 
-  //outb(0x80,LP);
   i = 0;
   for(;;){
     c = rx_miso();
@@ -129,535 +111,225 @@ void capture(char *fn)
   fclose(f);
 }
 
-unsigned char avr_rxtx(unsigned char x)
-{
-  bool c;
-  tx(x & 7);
-  if(opt_slow) udelay(20);
-  c = rx_miso();
-  /* printf("T(0x%02x) R(%d)\n", x, c); */
-  return c;
-}
-
-#define SAS_START 0xf
-#define SAS_DATA_0 0x2
-#define SAS_DATA_1 0x6
-#define SAS_STOP 0xe
-
-/* Send nibble LSB first. */
-static inline void sas_send_nibble(int tau, unsigned char x)
+void dump_ihex(int addr, const unsigned char *buf, int m)
 {
-  int i;
-  unsigned char xor;
-
-  xor = 0x00;
-  for(i = 0; i < 4; i++) {
-    tx(xor ^ (AVR_RST|((x & 1)?AVR_MOSI:0)));
-    udelay(tau);
-    tx(xor ^ (AVR_RST|((x & 1)?AVR_MOSI|AVR_SCLK:AVR_SCLK)));
-    udelay(tau);
-    /* printf("%c",x&1?'1':'0'); fflush(stdout); */
-    x >>= 1;
-  }
-  /* printf(" "); fflush(stdout); */
-}
+  unsigned char ck;
+  int i, j;
 
-void prototran(int tau, unsigned long x)
-{
-  unsigned long y;
-  int i;
-  unsigned char c; /* check byte */
-  bool ack1,ack2;
-  int retries;
-
-  c = - ((x & 0xff) + ((x >> 8) & 0xff) + ((x >> 16) & 0xff) + ((x >> 24) & 0xff));
-
-  ack1 = rx_miso();
-  for(retries = 0; retries < 500; retries ++) {
-    printf("Sending 0x%06lx...\n", x);
-
-    sas_send_nibble(tau, SAS_START);
-    sas_send_nibble(tau, SAS_START);
-    y = x;
-    for(i = 0; i < 32; i++) {
-      sas_send_nibble(tau, (y & 1) ? SAS_DATA_1:SAS_DATA_0);
-      y >>= 1;
-    }
-    y = c;
-    for(i = 0; i < 8; i++) {
-      sas_send_nibble(tau, (y & 1) ? SAS_DATA_1:SAS_DATA_0);
-      y >>= 1;
-    }
-    sas_send_nibble(tau, SAS_STOP);
-    ack2 = rx_miso();
-    if(ack1 != ack2) {
-      printf("Command acknowledged.\n");
-      break;
+  for(i = 0; i < m; i += 16, addr += 16) {
+    printf(":10%04X00", addr);
+    ck = (addr >> 8) + (addr & 0xff) + 0x10;
+    for(j = 0; j < 16; j++) {
+      printf("%02X", buf[i + j]);
+      ck += buf[i + j];
     }
+    printf("%02X\n", ((0xff ^ ck) + 1) & 0xff);
   }
-  if(retries == 500) {
-    printf("ERROR: Command not acknowledged after %d attempts (%d,%d).\n", ack1, ack2, retries);
-  }
-  tx(AVR_RST);
 }
-/* Power-up sequence */
 
-void avr_powerup(void) /* with XTAL */
+int dump_program_memory(int low_addr, int m)
 {
-  printf("Powering up.\n");
-
-  /* Apply power while _RESET and SCK are set to 0. */
-  (void) avr_rxtx(0);
-  udelay(100);
-  /* If the programmer cannot guarantee that SCK is held low during
-   * power-up, _RESET must be given a positive pulse after SCK
-   * has been set to 0. */
-  (void) avr_rxtx(AVR_RST);
-  udelay(1000);
-  (void) avr_rxtx(0);
-  /* Wait at least 20ms */
-  udelay(20000);
-}
-
-static inline void avr_delay(void)
-{
-  if(opt_slow) udelay(20);
-}
+  unsigned char buf[16];
+  int addr;
+  int status;
 
-unsigned short avr_byte(unsigned char x, unsigned char z, unsigned short res)
-{
-  unsigned i;
-
-  for(i = 0; i<8; i++) {
-    if(x & 0x80) {
-      (void) avr_rxtx(AVR_MOSI);
-      avr_delay();
-      z = avr_rxtx(AVR_MOSI|AVR_SCLK);
-      avr_delay();
-    } else {
-      (void) avr_rxtx(0);
-      avr_delay();
-      z = avr_rxtx(AVR_SCLK);
-      avr_delay();
-    }
-    res <<= 1;
-    if (z) res |= 1;
-    x = (x << 1) & 0xff;
+  for(addr = low_addr; addr < low_addr + m; addr += 16) {
+    status = avrprog_read_flash(ap, addr, 16, buf);
+    if(status) return status;
+    dump_ihex(addr, buf, 16);
   }
-  (void) avr_rxtx(0);
-
-  return res;
+  return AVRPROG_OK;
 }
 
-unsigned short avr_talk(unsigned char u1, unsigned char u2, unsigned char u3, unsigned char u4)
+/* Dump the pages that differ from a compiled image */
+int dump_compare(struct avrprog_image *img)
 {
-  unsigned short res;
-
-  /* printf("talk %02x %02x %02x %02x\n", u1, u2, u3, u4); */
-  res = 0;
-  avr_byte(u1,0,0);
-  res = avr_byte(u2,0,res);
-  avr_byte(u3,0,0);
-  res = avr_byte(u4,0,res);
-  return res;
-}
+  unsigned char buf[256];
+  int j, n;
+  int status;
 
-int avr_programming_enable()
-{
-  int i;
-  unsigned short res;
-  for(i = 0; i < 10; i++) {
-    res = avr_talk(0xac,0x53,0x00,0x00);
-    /* printf("0x%04x\n",res); */
-    if(0xac00 == (res & 0xff00)) {
-      return 1;
+  status = avrprog_image_check(ap, img);
+  if(status) return status;
+  n = 0;
+  for(j = 0; j < img->pages; j++) {
+    status = avrprog_read_flash(ap, j * img->page_size, img->page_size, buf);
+    if(status) return status;
+    if(avrprog_hash(buf, img->page_size) != avrprog_image_page_hash(img, j)) {
+      dump_ihex(j * img->page_size, buf, img->page_size);
+      n ++;
     }
   }
-  printf("No AVR chip found.\n");
-  return 0;
+  fprintf(stderr, "%d of %d page(s) differ.\n", n, img->pages);
+  return AVRPROG_OK;
 }
 
-void avr_verify_program_memory(unsigned char *flash, int low_addr, int m)
+int dump_signature(FILE *f)
 {
-  unsigned int addr;
-  unsigned short x,y;
-  unsigned char ck;
-  unsigned int errors = 0;
-  int j;
+  unsigned char sig[3];
+  int i;
+  int status;
 
-  for(addr = low_addr; addr < low_addr + m; ) {
-    ck = (addr >> 8) + (addr & 0xff) + 0x10;
-    for(j = 0; j < 8; j++) {
-      x = avr_talk(0x20, (addr >> 9),(addr >> 1) & 0xff,0x00) & 0xff;
-      addr ++;
-      y = avr_talk(0x28, (addr >> 9),(addr >> 1) & 0xff,0x00) & 0xff;
-      addr ++;
-      if(x != flash[addr - 2] || y != flash[addr - 1])
-      {
-        printf("ERROR at 0x%04x: %02X%02X in flash, %02X%02X in file", addr, x, y, flash[addr - 2], flash[addr - 1]);
-        errors ++;
-      }
-      ck += x + y;
-    }
-  }
-  if(!errors) printf("No errors.\n");
-  else
-  {
-    printf("ERRORS: Erroneous word count is %u\n", errors);
+  status = avrprog_read_signature(ap, sig);
+  if(status) return status;
+  for(i = 0; i < 3; i++) {
+    fprintf(f, "signature[0x%02x] = 0x%02x\n", i, sig[i]);
   }
+  return AVRPROG_OK;
 }
-void avr_dump_program_memory(int low_addr, int m)
-{
-  unsigned int addr;
-  unsigned short x,y;
-  unsigned char ck;
-  int j;
 
-  for(addr = low_addr; addr < low_addr + m; ) {
-    printf(":10%04X00", addr);
-    ck = (addr >> 8) + (addr & 0xff) + 0x10;
-    for(j = 0; j < 8; j++) {
-      x = avr_talk(0x20, (addr >> 9),(addr >> 1) & 0xff,0x00) & 0xff;
-      addr ++;
-      y = avr_talk(0x28, (addr >> 9),(addr >> 1) & 0xff,0x00) & 0xff;
-      addr ++;
-      printf("%02X%02X", x, y);
-      ck += x + y;
-    }
-    printf("%02X\n", ((0xff ^ ck) + 1) & 0xff);
-  }
+int pack_check(unsigned char *flash, int length)
+{
+  unsigned char *packed, *unpacked;
+  int n, m;
+  int ok;
+
+  packed = malloc(length + length / 32 + 4);
+  unpacked = malloc(length);
+  n = avrprog_pack(flash, length, packed);
+  m = avrprog_unpack(packed, n, unpacked, length);
+  ok = m == length && !memcmp(flash, unpacked, length);
+  printf("Packed %d bytes into %d (%.1f%%), CRC 0x%04x, round trip %s.\n",
+      length, n, 100.0 * n / (length ? length : 1), avrprog_crc16(0xffff, flash, length),
+      ok ? "OK" : "FAILED");
+  free(packed);
+  free(unpacked);
+  return ok;
 }
 
-void avr_dump_program_memory2(int low_addr, int m)
-{
-  unsigned int addr;
-  unsigned short x,y;
-
-  for(addr = low_addr; addr < low_addr + m; addr ++) {
-    x = avr_talk(0x20, (addr >> 9),(addr >> 1) & 0xff,0x00);
-    y = avr_talk(0x28, (addr >> 9),(addr >> 1) & 0xff,0x00);
-    printf("0x%04x %02x%02x\n", addr, x & 0xff, y & 0xff);
+void production(avrprog_job_t *job)
+{
+  unsigned char sig[3];
+  int board, passed, failed;
+  int ok;
+  struct timespec t0, t1;
+
+  printf("Production mode, waiting for boards.\n");
+  passed = failed = 0;
+  for(board = 1; ; board ++) {
+    if(avrprog_wait_board(ap, true, sig)) exit(EXIT_FAILURE);
+    printf("\nBoard %d inserted, signature %02x %02x %02x.\n", board, sig[0], sig[1], sig[2]);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ok = avrprog_job_run(ap, job, sig) == AVRPROG_OK;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if(ok) passed ++; else failed ++;
+    printf("\nBoard %d: %s in %.1f s (%d passed, %d failed)\n",
+        board, ok ? "PASS" : "FAIL",
+        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, passed, failed);
+    printf("Waiting for removal.\n");
+    fflush(stdout);
+    if(avrprog_wait_board(ap, false, sig)) exit(EXIT_FAILURE);
   }
 }
 
-#define GIVE_UP 10
-int avr_write_program_memory(int addr, unsigned short data)
+void estimate(const unsigned char *sig, const unsigned char *flash, int length,
+    const unsigned char *stub, int stub_length)
 {
-  unsigned short res;
-  int attempts;
-
-  (void) avr_talk(0x40, 0xff & (addr >> 8), addr & 0xff, data & 0x00ff);
-  for(attempts = 0; attempts < GIVE_UP; attempts ++) {
-    //udelay(5000);
-    res = avr_talk(0x20, 0xff & (addr >> 8), addr & 0xff, 0x00);
-    if((res & 0xff) == (data & 0xff)) break;
-  }
-  if(attempts == GIVE_UP) {
-    printf("write error : low at 0x%04x wrote 0x%02x reads back as 0x%02x\n", addr, data & 0xff, res & 0xff);
-    return 0;
-  }
+  struct avrprog_timing t;
+  struct avrprog_estimate e;
+  int i, status;
 
-  (void) avr_talk(0x48, 0xff & (addr >> 8), addr & 0xff, (data >> 8) & 0x00ff);
-  for(attempts = 0; attempts < GIVE_UP; attempts ++) {
-    //udelay(5000);
-    res = avr_talk(0x28, 0xff & (addr >> 8), addr & 0xff, 0x00);
-    if((res & 0xff) == ((data >> 8) & 0xff)) break;
+  if(have_profile) {
+    t = profile.timing;
+  } else if(avrprog_measure_timing(ap, &t)) {
+    exit(EXIT_FAILURE);
   }
-  if(attempts == GIVE_UP) {
-    printf("write error : hi at 0x%04x wrote 0x%02x reads back as 0x%02x\n", addr, (data >> 8) & 0xff, res & 0xff);
-    return 0;
+  printf("Timing%s: tx %.2f us, rx %.2f us, tx+rx %.2f us, sleep overshoot %.1f us.\n",
+      have_profile ? " (profile)" : "", t.tx, t.rx, t.txrx, t.sleep);
+  printf("Part %02x %02x %02x, %d (0x%04x) bytes.\n", sig[0], sig[1], sig[2], length, length);
+  printf("transport  wire bits   instrs    polls  poll ms  erase ms  program s  verify s  total s\n");
+  for(i = AVRPROG_PER_BIT; i <= AVRPROG_STREAMED; i++) {
+    status = avrprog_estimate(ap, &t, i, sig, flash, length, stub, stub_length, &e);
+    if(status) {
+      printf("%-9s  n/a%s\n", transport_names[i], status == AVRPROG_ERR_STUB ? " (give --stub <stub.hex>)" : "");
+      continue;
+    }
+    printf("%-9s %10lld %8ld %8ld %8.1f %9.1f %10.2f %9.2f %8.2f\n",
+        transport_names[i], e.wire_bits, e.instructions, e.polls,
+        e.poll_wait / 1e3, e.erase_wait / 1e3, e.program_time / 1e6, e.verify_time / 1e6,
+        (e.erase_wait + e.program_time + e.verify_time) / 1e6);
   }
-  return 1;
-}
-
-unsigned short avr_write_fuse_bits(unsigned char f_hi, unsigned char f_lo)
-{
-  printf("Writing fuse bytes: hi=0x%02x lo=0x%02x\n", f_hi, f_lo);
-  (void) avr_talk(0xac, 0xa0, 0x00, f_lo);
-  udelay(5000);
-  (void) avr_talk(0xac, 0xa8, 0x00, f_hi);
-  udelay(5000);
-  return 1;
 }
 
-unsigned short avr_read_lock_bits(FILE *out)
-{
-  unsigned char l;
-
-  l = avr_talk(0x98, 0x00, 0x00, 0x00) & 0x3f;
-  fprintf(out, "Read lock bits: 0x%02x\n", l);
-  return 1;
-}
-
-unsigned short avr_write_lock_bits(FILE *out, unsigned char l)
-{
-  printf("Writing lock bits 0x%02x\n", l);
-  avr_talk(0xac, 0xe0, 0x00, 0xc0 | l);
-  fprintf(out, "Wrote lock bits: 0x%02x\n", l);
-  return 1;
-}
-
-unsigned short avr_read_fuse_bits(FILE *out)
-{
-  unsigned char f_lo,f_hi;
-
-  f_lo = avr_talk(0x50, 0x00, 0x00, 0x00) & 0xff;
-  f_hi = avr_talk(0x58, 0x08, 0x00, 0x00) & 0xff;
-  fprintf(out, "Read fuse bytes: hi=0x%02x lo=0x%02x\n", f_hi, f_lo);
-  return 1;
-}
-
-void avr_chip_erase()
-{
-  printf("Erasing...\n");
-  (void) avr_talk(0xac,0x80,0x00,0x00);
-  udelay(2000000); /* 20ms delay */
-}
-
-unsigned short test1[] = {
-  0xc00c, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
-  0x0000, 0x0000, 0x0000, 0xef0f, 0xbb01, 0xbb00, 0xbb02, 0x9503, 0xcffd
-};
-
-void avr_program1200(unsigned char *flash, int length, int verify) /* must have been powered-up */
+void characterize(const char *fn)
 {
+  static const char *names[] = { "tx", "rx", "bitfield2", "udelay(10)", "udelay(100)", "udelay(1000)" };
+  const struct avrprog_stats *stats[] = { &profile.tx, &profile.rx, &profile.txrx,
+    &profile.sleep[0], &profile.sleep[1], &profile.sleep[2] };
   int i;
-  printf("Code length is %d (0x%x) bytes.\n", length, length);
-  for(i = 0; i<length / 2; i++) {
-    printf("\rProgramming byte : 0x%04x", 2*i); fflush(stdout);
-    if(!avr_write_program_memory(i,flash[2*i] | (flash[2*i + 1] << 8))) {
-      printf("Error, aborting.\n");
-      return;
-    }
+
+  if(avrprog_characterize(ap, &profile)) exit(EXIT_FAILURE);
+  printf("%-13s %9s %9s %9s %9s %9s\n", "us", "mean", "min", "median", "p99", "max");
+  for(i = 0; i < 6; i++) {
+    printf("%-13s %9.3f %9.3f %9.3f %9.3f %9.3f\n", names[i],
+        stats[i]->mean, stats[i]->min, stats[i]->median, stats[i]->p99, stats[i]->max);
+  }
+  printf("Update rate: tx %.0f/s, per-bit %.0f/s, batched %.0f/s.\n",
+      profile.tx_rate, profile.per_bit_rate, profile.batched_rate);
+  if(profile.loopback) {
+    printf("Loopback: %d MISO read(s), %.2f us to settle; batched read-back %s.\n",
+        profile.settle_reads, profile.settle_time, profile.batched_ok ? "OK" : "stale");
+  } else {
+    printf("No RST-MISO loopback, settling not measured.\n");
   }
-  return;
+  printf("Selected %s transport.\n", transport_names[profile.transport]);
+  if(avrprog_profile_save(ap, &profile, fn)) exit(EXIT_FAILURE);
+  have_profile = true;
+  avrprog_set_profile(ap, &profile);
 }
 
-enum
-{
-  AVR_LXAB    = 0x4d,
-  AVR_LPMP_LO = 0x40,
-  AVR_LPMP_HI = 0x48,
-  AVR_WPMP    = 0x4c,
-  AVR_RPMP_LO = 0x20,
-  AVR_RPMP_HI = 0x28,
-};
-
-/* program length is in BYTES */
-int avr_program_mega(unsigned char *flash, int length, int page_size, int flash_size, int verify) /* must have been powered-up */
+static char *next_arg(int *argc, char ***argv)
 {
-  int i, j;
-  int pages;
-  int this_length;
-  unsigned char x;
-  int byte_index;
-  int tries;
-  int okay;
-  unsigned char x1, x2;
-  unsigned char y1, y2;
-  int not_ff;
-
-  length = (length + 1) / 2; /* length in words */
-  pages = (length + page_size - 1) / page_size;
-  printf("Code length is %d (0x%x) words(s), %d page(s) of %d words.\n", length, length, pages, page_size);
-
-  avr_talk(AVR_LXAB, 0x00, 0x00, 0x00);
-
-  for(j = 0; j < pages; j ++) {
-    this_length = page_size;
-    printf("\nProgramming page %d : %d words (words 0x%04x to 0x%04x):\n",
-        j, this_length, j * page_size, (j + 1) * page_size - 1);
-    fflush(stdout);
-
-    not_ff = -1;
-
-    printf("%04x:", 2 * page_size * j);
-
-    for(i = 0; i < this_length; i++) {
-      byte_index = 2 * (page_size * j + i);
-      /*printf("\rProgramming byte : 0x%04x (byte 0x%02x of page %d)",
-                byte_index, 2 * i, j); fflush(stdout);*/
-
-      /* low byte first */
-      x = flash[byte_index];
-      printf("%02x", x);
-      if(x != 0xff) not_ff = byte_index;
-      (void) avr_talk(AVR_LPMP_LO, 0x00, i, x);
-
-      x = flash[byte_index + 1];
-      printf("%02x", x);
-      if(x != 0xff) not_ff = byte_index + 1;
-      (void) avr_talk(AVR_LPMP_HI, 0x00, i, x);
-    }
-    printf("\n");
-
-    if(not_ff < 0) {
-      printf("\nSkipping page %d (all-FF).\n", j);
-      continue;
-    }
-    /* write page */
-    printf("\nWriting page %d.\n", j);
-    (void) avr_talk(AVR_WPMP, (j * page_size) >> 8, (j * page_size) & 0xff, 0x00);
-
-    /* poll */
-    for(tries = 0; tries < 10000; tries ++)
-    {
-      if(not_ff & 1)
-        x1 = avr_talk(AVR_RPMP_HI, 0xff & (not_ff >> 9), (not_ff >> 1) & 0xff, 0x00);
-      else
-        x1 = avr_talk(AVR_RPMP_LO, 0xff & (not_ff >> 9), (not_ff >> 1) & 0xff, 0x00);
-
-      if(flash[not_ff] == x1) break;
-      udelay(10);
-    }
-    if(tries == 10000)
-    {
-      printf("ERROR: Polling failed after 1000 tries, not_ff=%d 0x%02x got 0x%02x.\n", not_ff, flash[not_ff], x1);
-      return 0;
-    }
-
-    printf("Verifying: ");
-    /* poll/verify */
-    do {
-      udelay(1);
-      okay = 1;
-      for(i = 0; i < this_length; i ++) {
-        byte_index = 2 * (page_size * j + i);
-        x1 = flash[byte_index];
-        x2 = avr_talk(AVR_RPMP_LO, 0xff & (byte_index >> 9), (byte_index >> 1) & 0xff, 0x00);
-
-        if(x1 != x2) {
-          printf("ERROR: At index %d byte 0x%02x reads back as 0x%02x.\n", byte_index, x1, x2);
-          return 0;
-        }
-        byte_index ++;
-        y1 = flash[byte_index];
-        y2 = avr_talk(AVR_RPMP_HI, 0xff & (byte_index >> 9), (byte_index >> 1) & 0xff, 0x00);
-        if(y1 != y2) {
-          printf("ERROR: At index %d byte 0x%02x reads back as 0x%02x.\n", byte_index, y1, y2);
-          return 0;
-        }
-      }
-    } while(0);
-    printf("OK.\n");
+  if(*argc > 0)
+  {
+    (*argc) --;
+    return *((*argv) ++);
+  }
+  else
+  {
+    fprintf(stderr, "Missing argument");
+    exit(EXIT_FAILURE);
   }
-  return 1;
 }
 
-int intelhex_load(char *fn, unsigned char *flash, int m)
+static int load(char *fn, unsigned char *flash, int m)
 {
-  unsigned int x;
   int n;
-  int i;
-  FILE *f;
-  char line[512];
-  unsigned char bytes[256];
-  int n_bytes;
-  int len;
-  unsigned char sum;
-  int addr;
-
-  f = fopen(fn, "r");
-  if(!f) {
-    return -1;
-  }
-
-  n = 0;
-  for(;;) {
-    if(fgets(line, sizeof(line), f)) {
-      if(line[0] == ':') {
-        for(n_bytes = 0, i = 1; isxdigit(line[i]) && isxdigit(line[i + 1]); i += 2) {
-          if(1 == sscanf(line + i, "%02x", &x)) {
-            bytes[n_bytes++] = x;
-          } else {
-            n = -1;
-            fprintf(stderr,"intelhex_load: file %s: bad line\n", fn);
-            goto bye;
-          }
-        }
-        if(n_bytes >= 2) {
-          len = bytes[0];
-          if(len + 5 != n_bytes) {
-            fprintf(stderr, "intelhex_load: bad record length\n");
-            n = -1;
-            goto bye;
-          }
-          sum = 0;
-          for(i = 0; i < n_bytes; i++) {
-            sum += bytes[i];
-          }
-          if(sum) {
-            fprintf(stderr, "intelhex_load: checksum error, got 0x%02x\n", sum);
-            n = -1;
-            goto bye;
-          }
 
-          switch(bytes[3]) {
-            case 0x00: /* data */
-              if(len >= 0) {
-                addr = (bytes[1] << 8) | bytes[2];
-                if(0 <= addr && addr + len < m) {
-                  for(i = 0; i < len; i++) {
-                    flash[addr + i] = bytes[4+i];
-                  }
-                  if(addr + len > n) n = addr + len;
-                } else {
-                  fprintf(stderr, "intelhex_load: address 0x%02x out of range\n", addr);
-                }
-              } else fprintf(stderr, "intelhex_load: short data record\n");
-              break;
-            case 0x01: /* eof */
-              goto bye;
-            default:
-              fprintf(stderr, "intelhex_load: unknown record type 0x%02x, ignoring\n", bytes[0]);
-              break;
-          }
-        }
-      } else {
-        fprintf(stderr,"intelhex_load: ignoring line\n");
-      }
-    } else break;
+  n = avrprog_ihex_load(ap, fn, flash, m);
+  if(n < 0) {
+    exit(EXIT_FAILURE);
   }
-
-bye:
-  fclose(f);
   return n;
 }
 
-unsigned char avr_read_signature(int i)
+static void parse_signature(char *s, unsigned char *sig)
 {
-  return avr_talk(0x30,0x00,i & 3,0x00);
+  unsigned long x;
+
+  x = strtoul(s, 0, 16);
+  sig[0] = x >> 16;
+  sig[1] = x >> 8;
+  sig[2] = x;
 }
 
-void avr_dump_signature(FILE *f)
+static void load_image(char *fn, struct avrprog_image *img)
 {
-  int i;
-  int sigaddrs[] = { 0x0,0x1,0x2 };
-
-  for(i = 0; i<sizeof(sigaddrs)/sizeof(*sigaddrs); i++) {
-    fprintf(f, "signature[0x%02x] = 0x%02x\n", sigaddrs[i], avr_read_signature(sigaddrs[i]));
+  if(avrprog_image_open(ap, fn, img)) {
+    exit(EXIT_FAILURE);
   }
+  printf("Image for %02x %02x %02x: %d (0x%04x) bytes, %d page(s)%s.\n",
+      img->signature[0], img->signature[1], img->signature[2],
+      img->length, img->length, img->pages, img->frames ? " with ISP frames" : "");
 }
 
 int main(int argc, char **argv)
 {
   char *fn, *cmd;
-  static unsigned char flash[8192];
+  static unsigned char flash[65536];
+  static unsigned char stub[65536];
+  int stub_length = -1;
   int n;
-
-  char *next_arg(void)
-  {
-    if(argc > 0)
-    {
-      argc --;
-      return *(argv ++);
-    }
-    else
-    {
-      fprintf(stderr, "Missing argument");
-      exit(EXIT_FAILURE);
-    }
-  }
+  int status;
 
   memset(flash, 0xff, sizeof(flash));
 
@@ -666,161 +338,268 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  dev = comedi_open("/dev/comedi0");
-
-  for(n = AVR_FIRST_OUTPUT_BIT; n <= AVR_LAST_OUTPUT_BIT; n ++)
-  {
-    if(comedi_dio_config(dev, DIO0SUBDEV, n, COMEDI_OUTPUT) < 0) {
-      printf("Can't configure digital output bit %d\n", n);
-      abort();
-    }
-  }
-
-  for(n = AVR_FIRST_INPUT_BIT; n <= AVR_LAST_INPUT_BIT; n ++)
-  {
-    if(comedi_dio_config(dev, DIO0SUBDEV, n, COMEDI_INPUT) < 0) {
-      printf("Can't configure digital input bit %d\n", n);
-      abort();
-    }
+  ap = avrprog_open(DIO0DEVICE, DIO0SUBDEV, &status);
+  if(!ap) {
+    printf("Can't open %s: %s\n", DIO0DEVICE, avrprog_strerror(status));
+    abort();
   }
+  avrprog_set_callbacks(ap, message, progress, NULL);
+  avrprog_set_journal(ap, JOURNAL_FILE, false);
 
   argc --;
   argv ++;
 
   while(argc > 0)
   {
-    cmd = next_arg();
+    cmd = next_arg(&argc, &argv);
 
     if(!strcmp(cmd,"prototran")) {
       int tau;
       unsigned long x;
 
-      tau = atoi(next_arg());
-      if (1 == sscanf(next_arg(), "%li",&x)) {
-        prototran(tau,x);
+      tau = atoi(next_arg(&argc, &argv));
+      if (1 == sscanf(next_arg(&argc, &argv), "%li",&x)) {
+        if(avrprog_prototran(ap, tau, x)) {
+          exit(EXIT_FAILURE);
+        }
       } else {
         fprintf(stderr, "Bad integer.\n");
         exit(EXIT_FAILURE);
       }
     } else if(!strcmp(cmd,"powerup")) {
-      tx(AVR_RST);
+      if(avrprog_set_lines(ap, AVRPROG_RST)) {
+        exit(EXIT_FAILURE);
+      }
     } else if(!strcmp(cmd,"set")) {
-      tx(atoi(next_arg()));
+      if(avrprog_set_lines(ap, atoi(next_arg(&argc, &argv)))) {
+        exit(EXIT_FAILURE);
+      }
     } else if(!strcmp(cmd,"monitor")) {
       monitor();
     } else if(!strcmp(cmd,"capture")) {
-      capture(next_arg());
+      capture(next_arg(&argc, &argv));
     } else if(!strcmp(cmd,"reset")) {
-      tx(0);
+      if(avrprog_set_lines(ap, 0)) {
+        exit(EXIT_FAILURE);
+      }
       udelay(1000000);
-      tx(AVR_RST);
+      if(avrprog_set_lines(ap, AVRPROG_RST)) {
+        exit(EXIT_FAILURE);
+      }
     } else if(!strcmp(cmd,"ihexchk")) {
-      fn = next_arg();
-      n = intelhex_load(fn, flash, sizeof(flash));
+      fn = next_arg(&argc, &argv);
+      n = load(fn, flash, sizeof(flash));
       printf("Loaded %d (0x%04x) bytes.\n", n, n);
+    } else if(!strcmp(cmd,"production")) {
+      struct avrprog_image img;
+      avrprog_job_t *job;
+      int fuse_hi, fuse_lo, lock;
+
+      if(argc != 4) {
+        fprintf(stderr,"usage: avrprogni production <file|image> <fuse_hi|-> <fuse_lo|-> <lock|->\n");
+        exit(1);
+      }
+      fn = next_arg(&argc, &argv);
+      cmd = next_arg(&argc, &argv);
+      fuse_hi = strcmp(cmd, "-") ? strtol(cmd, 0, 0) & 0xff : -1;
+      cmd = next_arg(&argc, &argv);
+      fuse_lo = strcmp(cmd, "-") ? strtol(cmd, 0, 0) & 0xff : -1;
+      if((fuse_hi < 0) != (fuse_lo < 0)) {
+        fprintf(stderr,"production: give both fuse bytes or neither\n");
+        exit(1);
+      }
+      cmd = next_arg(&argc, &argv);
+      lock = strcmp(cmd, "-") ? strtol(cmd, 0, 0) & 0xff : -1;
+      if(avrprog_image_probe(fn)) {
+        load_image(fn, &img);
+        job = avrprog_job_new_image(&img, fuse_hi, fuse_lo, lock);
+      } else {
+        n = load(fn, flash, sizeof(flash));
+        printf("Loaded %d (0x%04x) bytes.\n", n, n);
+        job = avrprog_job_new(flash, n, fuse_hi, fuse_lo, lock);
+      }
+      if(!job) exit(EXIT_FAILURE);
+      production(job);
+    } else if(!strcmp(cmd,"compile")) {
+      unsigned char sig[3];
+
+      if(argc < 3) {
+        fprintf(stderr,"usage: avrprogni compile <file> <signature> <image>\n");
+        exit(1);
+      }
+      n = load(next_arg(&argc, &argv), flash, sizeof(flash));
+      parse_signature(next_arg(&argc, &argv), sig);
+      if(avrprog_image_compile(ap, flash, n, sig, opt_frames, next_arg(&argc, &argv))) {
+        exit(EXIT_FAILURE);
+      }
+    } else if(!strcmp(cmd,"estimate")) {
+      fn = next_arg(&argc, &argv);
+      if(avrprog_image_probe(fn)) {
+        struct avrprog_image img;
+
+        load_image(fn, &img);
+        estimate(img.signature, img.data, img.length, stub_length < 0 ? NULL : stub, stub_length);
+        avrprog_image_close(&img);
+      } else {
+        unsigned char sig[3];
+
+        if(argc < 1) {
+          fprintf(stderr,"usage: avrprogni estimate <image> | estimate <file> <signature>\n");
+          exit(1);
+        }
+        n = load(fn, flash, sizeof(flash));
+        parse_signature(next_arg(&argc, &argv), sig);
+        estimate(sig, flash, n, stub_length < 0 ? NULL : stub, stub_length);
+      }
+    } else if(!strcmp(cmd,"characterize")) {
+      characterize(next_arg(&argc, &argv));
+    } else if(!strcmp(cmd,"profile")) {
+      if(avrprog_profile_load(ap, next_arg(&argc, &argv), &profile)) {
+        exit(EXIT_FAILURE);
+      }
+      have_profile = true;
+      avrprog_set_profile(ap, &profile);
+      printf("Using %s transport, %d MISO read(s) per update.\n",
+          transport_names[profile.transport], profile.settle_reads);
+    } else if(!strcmp(cmd, "--stub")) {
+      memset(stub, 0xff, sizeof(stub));
+      stub_length = load(next_arg(&argc, &argv), stub, sizeof(stub));
+    } else if(!strcmp(cmd, "--frames")) {
+      opt_frames = true;
+    } else if(!strcmp(cmd,"compress")) {
+      n = load(next_arg(&argc, &argv), flash, sizeof(flash));
+      if(!pack_check(flash, n)) exit(EXIT_FAILURE);
+    } else if(!strcmp(cmd, "--resume")) {
+      avrprog_set_journal(ap, JOURNAL_FILE, true);
     } else if(!strcmp(cmd, "slow")) {
       opt_slow = true;
+      avrprog_set_slow(ap, true);
       printf("Using SLOW mode.\n");
     } else {
-      avr_powerup();
-      if(avr_programming_enable()) {
+      if(avrprog_powerup(ap)) {
+        exit(EXIT_FAILURE);
+      } else {
         if(!strcmp(cmd,"erase")) {
-          avr_chip_erase();
+          if(avrprog_erase(ap)) {
+            exit(EXIT_FAILURE);
+          }
         } else if(!strcmp(cmd,"unlock")) {
-          avr_talk(0xac,0xff,0x00,0x00);
+          if(avrprog_unlock(ap)) {
+            exit(EXIT_FAILURE);
+          }
         } else if(!strcmp(cmd,"signature")) {
-          avr_dump_signature(stdout);
+          if(dump_signature(stdout)) {
+            exit(EXIT_FAILURE);
+          }
         } else if(!strcmp(cmd,"readfuse")) {
-          avr_read_fuse_bits(stdout);
+          unsigned char f_hi, f_lo;
+
+          if(avrprog_read_fuses(ap, &f_hi, &f_lo)) {
+            exit(EXIT_FAILURE);
+          }
+          printf("Read fuse bytes: hi=0x%02x lo=0x%02x\n", f_hi, f_lo);
         } else if(!strcmp(cmd,"readlock")) {
-          avr_read_lock_bits(stdout);
+          unsigned char l;
+
+          if(avrprog_read_lock(ap, &l)) {
+            exit(EXIT_FAILURE);
+          }
+          printf("Read lock bits: 0x%02x\n", l);
         } else if(!strcmp(cmd,"writelock")) {
-          if(argc != 3)
+          unsigned char l;
+
+          if(argc < 1)
           {
             fprintf(stderr,"usage: avrprogni writelock <lock>\n");
             exit(1);
           }
-          avr_write_lock_bits(stdout, strtol(next_arg(), 0, 0));
+          l = strtol(next_arg(&argc, &argv), 0, 0);
+          if(avrprog_write_lock(ap, l)) {
+            exit(EXIT_FAILURE);
+          }
+          printf("Wrote lock bits: 0x%02x\n", l);
         } else if(!strcmp(cmd,"writefuse")) {
           unsigned char f_hi;
           unsigned char f_lo;
-          if (argc != 4) {
+          if (argc < 2) {
             fprintf(stderr,"usage: avrprogni writefuse <fuse_hi> <fuse_lo>\n");
             exit(1);
           }
-          f_hi = strtol(next_arg(), 0, 0);
-          f_lo = strtol(next_arg(), 0, 0);
-          avr_write_fuse_bits(f_hi, f_lo);
+          f_hi = strtol(next_arg(&argc, &argv), 0, 0);
+          f_lo = strtol(next_arg(&argc, &argv), 0, 0);
+          if(avrprog_write_fuses(ap, f_hi, f_lo)) {
+            exit(EXIT_FAILURE);
+          }
         } else if(!strcmp(cmd,"dump")) {
-          avr_dump_program_memory(0,8192);
-        } else if(!strcmp(cmd,"verify")) {
-          fn = next_arg();
-          n = intelhex_load(fn, flash, sizeof(flash));
-          if(n < 0) {
+          if(dump_program_memory(0,8192)) {
             exit(EXIT_FAILURE);
           }
-          printf("Loaded %d (0x%04x) bytes.\n", n, n);
-          avr_verify_program_memory(flash,0,8192);
-        } else if(!strcmp(cmd,"1200program")) {
-          fn = next_arg();
-          n = intelhex_load(fn, flash, sizeof(flash));
-          if(n < 0) {
+        } else if(!strcmp(cmd,"dumpcmp")) {
+          struct avrprog_image img;
+
+          load_image(next_arg(&argc, &argv), &img);
+          if(dump_compare(&img)) {
             exit(EXIT_FAILURE);
           }
-          printf("Loaded %d bytes.\n", n);
-          avr_program1200(flash, n, 1);
-        } else if(!strcmp(cmd,"megaprogram")) {
-          unsigned char flash_code;
-          unsigned int flash_size, page_size;
+          avrprog_image_close(&img);
+        } else if(!strcmp(cmd,"verify")) {
+          fn = next_arg(&argc, &argv);
+          if(avrprog_image_probe(fn)) {
+            struct avrprog_image img;
 
-          fn = next_arg();
-          n = intelhex_load(fn, flash, sizeof(flash));
-          if(n < 0) {
+            load_image(fn, &img);
+            if(avrprog_verify_image(ap, &img, NULL)) {
+              exit(EXIT_FAILURE);
+            }
+            avrprog_image_close(&img);
+          } else {
+            n = load(fn, flash, sizeof(flash));
+            printf("Loaded %d (0x%04x) bytes.\n", n, n);
+            if(avrprog_verify(ap, flash, 0, 8192, NULL)) {
+              exit(EXIT_FAILURE);
+            }
+          }
+        } else if(!strcmp(cmd,"1200program")) {
+          n = load(next_arg(&argc, &argv), flash, sizeof(flash));
+          printf("Loaded %d bytes.\n", n);
+          if(avrprog_program_classic(ap, flash, n, true)) {
             exit(EXIT_FAILURE);
           }
-          printf("Loaded %d (0x%04x) bytes.\n", n, n);
-          
-          /* Determine flash size */
-          flash_code = avr_read_signature(0x01);
-          switch(flash_code)
-          {
-            case 0x92:
-              flash_size = 4096;
-              page_size = 32;
-              break;
-            case 0x93:
-              flash_size = 8192;
-              page_size = 32;
-              break;
-            case 0x94:
-              flash_size = 16384;
-              page_size = 64;
-              break;
-            case 0x95:
-              flash_size = 32768;
-              page_size = 64;
-              break;
-            case 0x96:
-              flash_size = 65536;
-              page_size = 128;
-              break;
-            default:
-              fprintf(stderr, "Unknown flash size code 0x%02x\n", flash_code);
+        } else if(!strcmp(cmd,"megaprogram")) {
+          fn = next_arg(&argc, &argv);
+          if(avrprog_image_probe(fn)) {
+            struct avrprog_image img;
+
+            load_image(fn, &img);
+            if(avrprog_program_image(ap, &img)) {
+              exit(EXIT_FAILURE);
+            }
+            avrprog_image_close(&img);
+          } else {
+            n = load(fn, flash, sizeof(flash));
+            printf("Loaded %d (0x%04x) bytes.\n", n, n);
+            if(avrprog_program_mega(ap, flash, n)) {
               exit(EXIT_FAILURE);
+            }
           }
-          printf("Flash size is %d bytes (page size %d)\n", flash_size, page_size);
-          if(n > flash_size)
-          {
-            fprintf(stderr, "Error: Program size exceeds flash size\n");
+        } else if(!strcmp(cmd,"stubprogram")) {
+          int m;
+
+          memset(stub, 0xff, sizeof(stub));
+          m = load(next_arg(&argc, &argv), stub, sizeof(stub));
+          n = load(next_arg(&argc, &argv), flash, sizeof(flash));
+          printf("Loaded %d (0x%04x) bytes.\n", n, n);
+          if(avrprog_stub_program(ap, stub, m, flash, n)) {
             exit(EXIT_FAILURE);
           }
-          avr_program_mega(flash, n, page_size, flash_size, 1);
         } else {
           printf("Unknown operation %s\n", cmd);
+          exit(EXIT_FAILURE);
         }
       }
     }
   }
 
+  avrprog_close(ap);
   return 0;
 }
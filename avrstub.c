@@ -0,0 +1,249 @@
+/* Resident loader for avrprogni's "stubprogram" command
+ * Copyright (C)2004-2010 Berke Durak
+ * Released in the public domain.
+ *
+ * Built with avr-gcc for the boot section ("make avrstub.hex"), it is
+ * ISP-programmed first and then receives the image as a packed stream
+ * over the ISP pins, unpacks it and writes the flash pages itself.  The
+ * BOOTRST fuse must be programmed and BOOTSZ must match STUB_START.
+ *
+ * At reset the stub only stays if SCK is held high, otherwise it jumps
+ * to the application.  See libavrprog.c for the packed format and the
+ * protocol; unpack() there is the reference model of the code below. */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
+
+#ifndef STUB_START
+#error "STUB_START must be the byte address the stub is linked at"
+#endif
+
+#if defined(__AVR_ATmega16__) || defined(__AVR_ATmega32__) || \
+    defined(__AVR_ATmega164P__) || defined(__AVR_ATmega324P__) || \
+    defined(__AVR_ATmega644P__)
+#define ISP_MOSI PB5
+#define ISP_MISO PB6
+#define ISP_SCK  PB7
+#else /* ATmega8/48/88/168/328 */
+#define ISP_MOSI PB3
+#define ISP_MISO PB4
+#define ISP_SCK  PB5
+#endif
+
+#define SCK_HIGH    (PINB & _BV(ISP_SCK))
+#define MOSI_HIGH   (PINB & _BV(ISP_MOSI))
+#define MISO_SET(x) do { if(x) PORTB |= _BV(ISP_MISO); else PORTB &= ~_BV(ISP_MISO); } while(0)
+
+enum
+{
+  PACK_LITERAL = 0x00,
+  PACK_RUN     = 0x40,
+  PACK_COPY    = 0x80,
+  PACK_END     = 0xc0,
+};
+
+enum
+{
+  STUB_OK = 0,
+  STUB_ERR_FORMAT = 1,   /* bad copy distance */
+  STUB_ERR_RANGE = 2,    /* image runs into the stub */
+  STUB_ERR_COMMAND = 3,  /* data after the end of the stream */
+};
+
+#define STUB_BLOCK 128
+
+static uint8_t block[STUB_BLOCK];
+static uint8_t block_len, block_pos;
+static uint8_t block_pending;
+static uint8_t status;
+static uint8_t done;
+
+static uint8_t page[SPM_PAGESIZE];
+static uint16_t out_addr;
+
+static uint8_t xfer(uint8_t x)
+{
+  uint8_t i, in;
+
+  in = 0;
+  for(i = 0; i < 8; i++) {
+    MISO_SET(x & 0x80);
+    x <<= 1;
+    while(!SCK_HIGH);
+    in <<= 1;
+    if(MOSI_HIGH) in |= 1;
+    while(SCK_HIGH);
+  }
+  return in;
+}
+
+/* Signal ready, then send the reply after the host's dummy byte */
+static void reply(uint8_t n, uint8_t *r)
+{
+  MISO_SET(0);
+  (void) xfer(0x00);
+  while(n--) (void) xfer(*r++);
+}
+
+static uint16_t receive16(void)
+{
+  uint16_t x;
+
+  x = xfer(0xff);
+  return x | (xfer(0xff) << 8);
+}
+
+/* Handle commands until a data block has been received */
+static void command(void)
+{
+  uint8_t r[4];
+  uint16_t n, a, crc;
+  uint8_t c;
+
+  for(;;) {
+    c = xfer(0xff);
+    switch(c) {
+      case 'S':
+        r[0] = SPM_PAGESIZE & 0xff;
+        r[1] = SPM_PAGESIZE >> 8;
+        r[2] = STUB_START & 0xff;
+        r[3] = STUB_START >> 8;
+        reply(4, r);
+        break;
+      case 'B':
+        block_len = xfer(0xff);
+        for(block_pos = 0; block_pos < block_len; block_pos++) block[block_pos] = xfer(0xff);
+        block_pos = 0;
+        block_pending = 1;
+        if(done) status = STUB_ERR_COMMAND;
+        return;
+      case 'C':
+        n = receive16();
+        crc = 0xffff;
+        for(a = 0; a < n; a++) crc = _crc16_update(crc, pgm_read_byte(a));
+        r[0] = crc & 0xff;
+        r[1] = crc >> 8;
+        reply(2, r);
+        break;
+      case 'Q':
+        DDRB &= ~_BV(ISP_MISO);
+        ((void (*)(void)) 0)();
+        break;
+    }
+  }
+}
+
+static uint8_t next_in(void)
+{
+  while(block_pos == block_len) {
+    if(block_pending) {
+      block_pending = 0;
+      reply(1, &status);
+    }
+    command();
+  }
+  return block[block_pos++];
+}
+
+static void flush(void)
+{
+  uint16_t base, i;
+  uint8_t used;
+
+  base = (out_addr - 1) & ~(SPM_PAGESIZE - 1);
+  used = 0;
+  for(i = 0; i < SPM_PAGESIZE; i++) used |= ~page[i];
+  if(used) {
+    /* the chip was erased before the stub went in */
+    for(i = 0; i < SPM_PAGESIZE; i += 2) boot_page_fill(base + i, page[i] | (page[i + 1] << 8));
+    boot_page_write(base);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+  }
+  for(i = 0; i < SPM_PAGESIZE; i++) page[i] = 0xff;
+}
+
+static void out(uint8_t x)
+{
+  if(out_addr >= STUB_START) {
+    status = STUB_ERR_RANGE;
+    return;
+  }
+  page[out_addr % SPM_PAGESIZE] = x;
+  out_addr ++;
+  if(!(out_addr % SPM_PAGESIZE)) flush();
+}
+
+static uint8_t out_get(uint16_t addr)
+{
+  if(addr >= (out_addr & ~(SPM_PAGESIZE - 1))) return page[addr % SPM_PAGESIZE];
+  return pgm_read_byte(addr);
+}
+
+static uint8_t pack_min(uint8_t type)
+{
+  return type == PACK_LITERAL ? 1 : type == PACK_RUN ? 3 : 4;
+}
+
+static void unpack(void)
+{
+  uint8_t t, type, x;
+  uint16_t len, dist;
+
+  for(;;) {
+    t = next_in();
+    type = t & 0xc0;
+    if(type == PACK_END) return;
+    len = t & 0x3f;
+    if(len == 63) {
+      len = next_in();
+      len |= next_in() << 8;
+    } else len += pack_min(type);
+
+    switch(type) {
+      case PACK_LITERAL:
+        while(len-- && !status) out(next_in());
+        break;
+      case PACK_RUN:
+        x = next_in();
+        while(len-- && !status) out(x);
+        break;
+      case PACK_COPY:
+        dist = next_in();
+        dist |= next_in() << 8;
+        if(!dist || dist > out_addr) status = STUB_ERR_FORMAT;
+        while(len-- && !status) out(out_get(out_addr - dist));
+        break;
+    }
+    if(status) return;
+  }
+}
+
+int main(void)
+{
+  uint16_t i;
+
+  if(!SCK_HIGH) ((void (*)(void)) 0)();
+
+  DDRB |= _BV(ISP_MISO);
+  MISO_SET(1);
+  while(SCK_HIGH);
+
+  for(i = 0; i < SPM_PAGESIZE; i++) page[i] = 0xff;
+  MISO_SET(0);
+
+  unpack();
+  if(out_addr % SPM_PAGESIZE) flush();
+
+  done = 1;
+  for(;;) {
+    if(block_pending) {
+      block_pending = 0;
+      reply(1, &status);
+    }
+    command();
+  }
+}
@@ -0,0 +1,2377 @@
+/* Atmel AVR programmer library
+ * Copyright (C)2004-2010 Berke Durak
+ * Released in the public domain. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <comedilib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libavrprog.h"
+
+enum
+{
+  AVR_MOSI_BIT         = 0,
+  AVR_SCLK_BIT         = 1,
+  AVR_RST_BIT          = 2,
+  AVR_FIRST_OUTPUT_BIT = AVR_MOSI_BIT,
+  AVR_LAST_OUTPUT_BIT  = AVR_RST_BIT,
+
+  AVR_MISO_BIT         = 3,
+  AVR_FIRST_INPUT_BIT  = AVR_MISO_BIT,
+  AVR_LAST_INPUT_BIT   = AVR_MISO_BIT
+};
+
+#define AVR_MOSI     AVRPROG_MOSI
+#define AVR_SCLK     AVRPROG_SCLK
+#define AVR_RST      AVRPROG_RST
+#define AVR_OUTBITS  (AVR_MOSI|AVR_SCLK|AVR_RST)
+#define AVR_MISO     (1 << AVR_MISO_BIT)
+#define AVR_INBITS   (AVR_MISO)
+
+struct avrprog
+{
+  comedi_t *dev;
+  int subdev;
+  bool io_error;
+
+  bool slow;
+  bool resume;
+  char *journal;
+  enum avrprog_transport transport;
+  int settle_reads;  /* MISO reads per line update */
+
+  avrprog_message_fn *message;
+  avrprog_progress_fn *progress;
+  void *user;
+};
+
+static void avr_message(avrprog_t *ap, enum avrprog_level level, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+static void avr_message(avrprog_t *ap, enum avrprog_level level, const char *fmt, ...)
+{
+  char buf[512];
+  va_list va;
+
+  if(!ap || !ap->message) return;
+  va_start(va, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, va);
+  va_end(va);
+  ap->message(ap->user, level, buf);
+}
+
+#define avr_info(ap, ...)  avr_message(ap, AVRPROG_INFO, __VA_ARGS__)
+#define avr_error(ap, ...) avr_message(ap, AVRPROG_ERROR, __VA_ARGS__)
+
+static inline void avr_progress(avrprog_t *ap, enum avrprog_phase phase, int done, int total)
+{
+  if(ap->progress) ap->progress(ap->user, phase, done, total);
+}
+
+static inline void udelay(avrprog_t *ap, int t_us)
+{
+  struct timespec ts;
+
+  if(ap->slow) t_us *= 10;
+  ts.tv_sec = t_us / 1000000;
+  ts.tv_nsec = (t_us % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+static inline long long now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Line I/O.  Errors are latched in io_error and turned into
+ * AVRPROG_ERR_DEVICE by the public entry points. */
+
+static void tx(avrprog_t *ap, unsigned char x0)
+{
+  unsigned int x;
+
+  x = x0;
+  if(comedi_dio_bitfield2(ap->dev, ap->subdev, AVR_OUTBITS, &x, AVR_FIRST_OUTPUT_BIT) < 0)
+    ap->io_error = true;
+  /*printf(">> 0x%02x\n", x);*/
+}
+
+static bool rx_miso(avrprog_t *ap)
+{
+  unsigned int x;
+  if(comedi_dio_read(ap->dev, ap->subdev, AVR_MISO_BIT, &x) < 0)
+  {
+    ap->io_error = true;
+    return false;
+  }
+  /*printf("<< %u\n", x);*/
+  return x == 1;
+}
+
+static int avr_status(avrprog_t *ap, int status)
+{
+  if(ap->io_error) {
+    ap->io_error = false;
+    avr_error(ap, "Bit read/write error\n");
+    return AVRPROG_ERR_DEVICE;
+  }
+  return status;
+}
+
+avrprog_t *avrprog_open(const char *device, int subdevice, int *status)
+{
+  avrprog_t *ap;
+  int n;
+
+  ap = calloc(1, sizeof(*ap));
+  if(!ap) {
+    if(status) *status = AVRPROG_ERR_DEVICE;
+    return NULL;
+  }
+  ap->subdev = subdevice;
+  ap->transport = AVRPROG_PER_BIT;
+  ap->settle_reads = 1;
+
+  ap->dev = comedi_open(device);
+  if(!ap->dev) goto fail;
+
+  for(n = AVR_FIRST_OUTPUT_BIT; n <= AVR_LAST_OUTPUT_BIT; n ++)
+  {
+    if(comedi_dio_config(ap->dev, ap->subdev, n, COMEDI_OUTPUT) < 0) goto fail;
+  }
+
+  for(n = AVR_FIRST_INPUT_BIT; n <= AVR_LAST_INPUT_BIT; n ++)
+  {
+    if(comedi_dio_config(ap->dev, ap->subdev, n, COMEDI_INPUT) < 0) goto fail;
+  }
+
+  if(status) *status = AVRPROG_OK;
+  return ap;
+
+fail:
+  if(status) *status = AVRPROG_ERR_DEVICE;
+  avrprog_close(ap);
+  return NULL;
+}
+
+void avrprog_close(avrprog_t *ap)
+{
+  if(!ap) return;
+  if(ap->dev) comedi_close(ap->dev);
+  free(ap->journal);
+  free(ap);
+}
+
+const char *avrprog_strerror(int status)
+{
+  switch(status) {
+    case AVRPROG_OK:          return "Success";
+    case AVRPROG_ERR_DEVICE:  return "DIO device error";
+    case AVRPROG_ERR_NO_CHIP: return "No AVR chip found";
+    case AVRPROG_ERR_PART:    return "Unknown or unexpected part";
+    case AVRPROG_ERR_SIZE:    return "Program size exceeds flash size";
+    case AVRPROG_ERR_WRITE:   return "Write timed out";
+    case AVRPROG_ERR_VERIFY:  return "Verify error";
+    case AVRPROG_ERR_FUSE:    return "Fuse verify error";
+    case AVRPROG_ERR_FILE:    return "Bad or unreadable file";
+    case AVRPROG_ERR_STUB:    return "Stub loader error";
+    case AVRPROG_ERR_NACK:    return "Command not acknowledged";
+    default:                  return "Unknown error";
+  }
+}
+
+void avrprog_set_callbacks(avrprog_t *ap, avrprog_message_fn *message, avrprog_progress_fn *progress, void *user)
+{
+  ap->message = message;
+  ap->progress = progress;
+  ap->user = user;
+}
+
+void avrprog_set_slow(avrprog_t *ap, bool slow)
+{
+  ap->slow = slow;
+}
+
+void avrprog_set_journal(avrprog_t *ap, const char *journal, bool resume)
+{
+  free(ap->journal);
+  ap->journal = journal ? strdup(journal) : NULL;
+  ap->resume = resume;
+}
+
+int avrprog_set_lines(avrprog_t *ap, unsigned bits)
+{
+  tx(ap, bits);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_read_miso(avrprog_t *ap, bool *miso)
+{
+  *miso = rx_miso(ap);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+static unsigned char avr_rxtx(avrprog_t *ap, unsigned char x)
+{
+  bool c;
+  unsigned int y;
+  int i;
+
+  if(ap->transport == AVRPROG_BATCHED && !ap->slow) {
+    /* the read-back of the same call carries MISO */
+    y = x & 7;
+    if(comedi_dio_bitfield2(ap->dev, ap->subdev, AVR_OUTBITS, &y, AVR_FIRST_OUTPUT_BIT) < 0)
+      ap->io_error = true;
+    return (y >> (AVR_MISO_BIT - AVR_FIRST_OUTPUT_BIT)) & 1;
+  }
+  tx(ap, x & 7);
+  if(ap->slow) udelay(ap, 20);
+  c = rx_miso(ap);
+  for(i = 1; i < ap->settle_reads; i++) c = rx_miso(ap);
+  /* printf("T(0x%02x) R(%d)\n", x, c); */
+  return c;
+}
+
+#define SAS_START 0xf
+#define SAS_DATA_0 0x2
+#define SAS_DATA_1 0x6
+#define SAS_STOP 0xe
+
+/* Send nibble LSB first. */
+static inline void sas_send_nibble(avrprog_t *ap, int tau, unsigned char x)
+{
+  int i;
+  unsigned char xor;
+
+  xor = 0x00;
+  for(i = 0; i < 4; i++) {
+    tx(ap, xor ^ (AVR_RST|((x & 1)?AVR_MOSI:0)));
+    udelay(ap, tau);
+    tx(ap, xor ^ (AVR_RST|((x & 1)?AVR_MOSI|AVR_SCLK:AVR_SCLK)));
+    udelay(ap, tau);
+    x >>= 1;
+  }
+}
+
+int avrprog_prototran(avrprog_t *ap, int tau, unsigned long x)
+{
+  unsigned long y;
+  int i;
+  unsigned char c; /* check byte */
+  bool ack1,ack2;
+  int retries;
+
+  c = - ((x & 0xff) + ((x >> 8) & 0xff) + ((x >> 16) & 0xff) + ((x >> 24) & 0xff));
+
+  ack1 = rx_miso(ap);
+  ack2 = ack1;
+  for(retries = 0; retries < 500; retries ++) {
+    avr_info(ap, "Sending 0x%06lx...\n", x);
+
+    sas_send_nibble(ap, tau, SAS_START);
+    sas_send_nibble(ap, tau, SAS_START);
+    y = x;
+    for(i = 0; i < 32; i++) {
+      sas_send_nibble(ap, tau, (y & 1) ? SAS_DATA_1:SAS_DATA_0);
+      y >>= 1;
+    }
+    y = c;
+    for(i = 0; i < 8; i++) {
+      sas_send_nibble(ap, tau, (y & 1) ? SAS_DATA_1:SAS_DATA_0);
+      y >>= 1;
+    }
+    sas_send_nibble(ap, tau, SAS_STOP);
+    ack2 = rx_miso(ap);
+    if(ack1 != ack2) {
+      avr_info(ap, "Command acknowledged.\n");
+      break;
+    }
+  }
+  tx(ap, AVR_RST);
+  if(retries == 500) {
+    avr_error(ap, "ERROR: Command not acknowledged after %d attempts (%d,%d).\n", retries, ack1, ack2);
+    return avr_status(ap, AVRPROG_ERR_NACK);
+  }
+  return avr_status(ap, AVRPROG_OK);
+}
+
+/* Power-up sequence */
+
+static void avr_reset_sequence(avrprog_t *ap)
+{
+  /* Apply power while _RESET and SCK are set to 0. */
+  (void) avr_rxtx(ap, 0);
+  udelay(ap, 100);
+  /* If the programmer cannot guarantee that SCK is held low during
+   * power-up, _RESET must be given a positive pulse after SCK
+   * has been set to 0. */
+  (void) avr_rxtx(ap, AVR_RST);
+  udelay(ap, 1000);
+  (void) avr_rxtx(ap, 0);
+  /* Wait at least 20ms */
+  udelay(ap, 20000);
+}
+
+static inline void avr_delay(avrprog_t *ap)
+{
+  if(ap->slow) udelay(ap, 20);
+}
+
+static unsigned short avr_byte(avrprog_t *ap, unsigned char x, unsigned char z, unsigned short res)
+{
+  unsigned i;
+
+  for(i = 0; i<8; i++) {
+    if(x & 0x80) {
+      (void) avr_rxtx(ap, AVR_MOSI);
+      avr_delay(ap);
+      z = avr_rxtx(ap, AVR_MOSI|AVR_SCLK);
+      avr_delay(ap);
+    } else {
+      (void) avr_rxtx(ap, 0);
+      avr_delay(ap);
+      z = avr_rxtx(ap, AVR_SCLK);
+      avr_delay(ap);
+    }
+    res <<= 1;
+    if (z) res |= 1;
+    x = (x << 1) & 0xff;
+  }
+  (void) avr_rxtx(ap, 0);
+
+  return res;
+}
+
+static unsigned short avr_talk(avrprog_t *ap, unsigned char u1, unsigned char u2, unsigned char u3, unsigned char u4)
+{
+  unsigned short res;
+
+  /* printf("talk %02x %02x %02x %02x\n", u1, u2, u3, u4); */
+  res = 0;
+  avr_byte(ap, u1,0,0);
+  res = avr_byte(ap, u2,0,res);
+  avr_byte(ap, u3,0,0);
+  res = avr_byte(ap, u4,0,res);
+  return res;
+}
+
+static int avr_try_programming_enable(avrprog_t *ap, int tries)
+{
+  int i;
+  unsigned short res;
+  for(i = 0; i < tries; i++) {
+    res = avr_talk(ap, 0xac,0x53,0x00,0x00);
+    /* printf("0x%04x\n",res); */
+    if(0xac00 == (res & 0xff00)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int avrprog_powerup(avrprog_t *ap) /* with XTAL */
+{
+  avr_info(ap, "Powering up.\n");
+  avr_reset_sequence(ap);
+  if(avr_try_programming_enable(ap, 10)) return avr_status(ap, AVRPROG_OK);
+  avr_error(ap, "No AVR chip found.\n");
+  return avr_status(ap, AVRPROG_ERR_NO_CHIP);
+}
+
+static unsigned char avr_read_signature(avrprog_t *ap, int i)
+{
+  return avr_talk(ap, 0x30,0x00,i & 3,0x00);
+}
+
+int avrprog_read_signature(avrprog_t *ap, unsigned char *sig)
+{
+  int i;
+
+  for(i = 0; i < 3; i++) sig[i] = avr_read_signature(ap, i);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+static int avr_verify_program_memory(avrprog_t *ap, const unsigned char *flash, int low_addr, int m)
+{
+  unsigned int addr;
+  unsigned short x,y;
+  unsigned char hi;
+  unsigned int errors = 0;
+
+  for(addr = low_addr; addr < low_addr + m; addr += 2) {
+    x = avr_talk(ap, 0x20, (addr >> 9),(addr >> 1) & 0xff,0x00) & 0xff;
+    y = avr_talk(ap, 0x28, (addr >> 9),(addr >> 1) & 0xff,0x00) & 0xff;
+    /* an odd length ends with a low byte */
+    hi = addr + 1 < low_addr + m ? flash[addr + 1] : y;
+    if(x != flash[addr] || y != hi)
+    {
+      avr_error(ap, "ERROR at 0x%04x: %02X%02X in flash, %02X%02X in file\n", addr, x, y, flash[addr], hi);
+      errors ++;
+    }
+    avr_progress(ap, AVRPROG_PHASE_VERIFY, addr + 2 - low_addr < m ? addr + 2 - low_addr : m, m);
+  }
+  if(!errors) avr_info(ap, "No errors.\n");
+  else
+  {
+    avr_error(ap, "ERRORS: Erroneous word count is %u\n", errors);
+  }
+  return errors;
+}
+
+int avrprog_verify(avrprog_t *ap, const unsigned char *flash, int addr, int length, int *errors)
+{
+  int n;
+
+  n = avr_verify_program_memory(ap, flash, addr, length);
+  if(errors) *errors = n;
+  return avr_status(ap, n ? AVRPROG_ERR_VERIFY : AVRPROG_OK);
+}
+
+int avrprog_read_flash(avrprog_t *ap, int addr, int length, unsigned char *buf)
+{
+  int i;
+
+  for(i = 0; i < length; i++, addr++) {
+    buf[i] = avr_talk(ap, (addr & 1) ? 0x28 : 0x20, (addr >> 9), (addr >> 1) & 0xff, 0x00) & 0xff;
+  }
+  return avr_status(ap, AVRPROG_OK);
+}
+
+/* Classic (non-paged) AVRs write flash one byte at a time.  While a
+ * byte is being written, reading its location back returns a fixed
+ * value instead of the data; bytes equal to that value cannot be
+ * data-polled and need the full write delay instead. */
+struct avr_classic_part
+{
+  const char *name;
+  unsigned char signature[3];
+  int flash_size;              /* bytes */
+  unsigned char readback[2];   /* flash values that defeat data polling */
+  int max_write_delay;         /* us, tWD_FLASH */
+};
+
+static const struct avr_classic_part avr_classic_parts[] =
+{
+  { "AT90S1200", { 0x1e, 0x90, 0x01 }, 1024, { 0xff, 0xff }, 9000 },
+  { "AT90S2313", { 0x1e, 0x91, 0x01 }, 2048, { 0x7f, 0x7f }, 9000 },
+  { "AT90S2323", { 0x1e, 0x91, 0x02 }, 2048, { 0xff, 0xff }, 9000 },
+  { "AT90S2343", { 0x1e, 0x91, 0x03 }, 2048, { 0xff, 0xff }, 9000 },
+  { "AT90S2333", { 0x1e, 0x91, 0x05 }, 2048, { 0xff, 0xff }, 9000 },
+  { "AT90S4414", { 0x1e, 0x92, 0x01 }, 4096, { 0x7f, 0x7f }, 9000 },
+  { "AT90S4434", { 0x1e, 0x92, 0x02 }, 4096, { 0xff, 0xff }, 9000 },
+  { "AT90S4433", { 0x1e, 0x92, 0x03 }, 4096, { 0xff, 0xff }, 9000 },
+  { "AT90S8515", { 0x1e, 0x93, 0x01 }, 8192, { 0x7f, 0x7f }, 9000 },
+  { "AT90S8535", { 0x1e, 0x93, 0x03 }, 8192, { 0xff, 0xff }, 9000 },
+};
+
+/* Used when the signature is unknown (or the part is locked): never
+ * poll, always wait the worst-case delay. */
+static const struct avr_classic_part avr_classic_unknown =
+  { "unknown", { 0x00, 0x00, 0x00 }, 8192, { 0x00, 0x00 }, 9000 };
+
+/* Whether a write of x can be data-polled */
+static inline bool avr_classic_pollable(const struct avr_classic_part *part, unsigned char x)
+{
+  return part != &avr_classic_unknown && x != part->readback[0] && x != part->readback[1];
+}
+
+#define POLL_TIMEOUT_FACTOR 4
+static int avr_write_program_byte(avrprog_t *ap, const struct avr_classic_part *part, int addr, unsigned char x)
+{
+  unsigned char y;
+  unsigned char op_write, op_read;
+  int waddr;
+  long long deadline;
+
+  waddr = addr >> 1;
+  op_write = (addr & 1) ? 0x48 : 0x40;
+  op_read  = (addr & 1) ? 0x28 : 0x20;
+
+  (void) avr_talk(ap, op_write, 0xff & (waddr >> 8), waddr & 0xff, x);
+
+  if(!avr_classic_pollable(part, x)) {
+    udelay(ap, part->max_write_delay);
+    return 1;
+  }
+
+  /* data polling */
+  deadline = now_us() + POLL_TIMEOUT_FACTOR * part->max_write_delay;
+  do {
+    y = avr_talk(ap, op_read, 0xff & (waddr >> 8), waddr & 0xff, 0x00) & 0xff;
+    if(y == x) return 1;
+  } while(now_us() < deadline && !ap->io_error);
+
+  avr_error(ap, "write error : at 0x%04x wrote 0x%02x reads back as 0x%02x\n", addr, x, y);
+  return 0;
+}
+
+int avrprog_write_fuses(avrprog_t *ap, unsigned char f_hi, unsigned char f_lo)
+{
+  avr_info(ap, "Writing fuse bytes: hi=0x%02x lo=0x%02x\n", f_hi, f_lo);
+  (void) avr_talk(ap, 0xac, 0xa0, 0x00, f_lo);
+  udelay(ap, 5000);
+  (void) avr_talk(ap, 0xac, 0xa8, 0x00, f_hi);
+  udelay(ap, 5000);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_read_lock(avrprog_t *ap, unsigned char *lock)
+{
+  *lock = avr_talk(ap, 0x98, 0x00, 0x00, 0x00) & 0x3f;
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_write_lock(avrprog_t *ap, unsigned char l)
+{
+  avr_info(ap, "Writing lock bits 0x%02x\n", l);
+  avr_talk(ap, 0xac, 0xe0, 0x00, 0xc0 | l);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_read_fuses(avrprog_t *ap, unsigned char *f_hi, unsigned char *f_lo)
+{
+  *f_lo = avr_talk(ap, 0x50, 0x00, 0x00, 0x00) & 0xff;
+  *f_hi = avr_talk(ap, 0x58, 0x08, 0x00, 0x00) & 0xff;
+  return avr_status(ap, AVRPROG_OK);
+}
+
+#define ERASE_DELAY 2000000 /* us, generous */
+/* tWD_ERASE, used in production */
+#define ERASE_TIME_CLASSIC 20000 /* us */
+#define ERASE_TIME_MEGA 9000 /* us */
+
+static void avr_chip_erase_wait(avrprog_t *ap, int t_us)
+{
+  avr_info(ap, "Erasing...\n");
+  (void) avr_talk(ap, 0xac,0x80,0x00,0x00);
+  udelay(ap, t_us);
+}
+
+static void avr_chip_erase(avrprog_t *ap)
+{
+  avr_chip_erase_wait(ap, ERASE_DELAY);
+}
+
+int avrprog_erase(avrprog_t *ap)
+{
+  avr_chip_erase(ap);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_unlock(avrprog_t *ap)
+{
+  avr_talk(ap, 0xac,0xff,0x00,0x00);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+static const struct avr_classic_part *avr_classic_part_find(const unsigned char *sig)
+{
+  int i;
+
+  for(i = 0; i < sizeof(avr_classic_parts)/sizeof(*avr_classic_parts); i++) {
+    if(!memcmp(sig, avr_classic_parts[i].signature, 3)) return &avr_classic_parts[i];
+  }
+  return NULL;
+}
+
+static const struct avr_classic_part *avr_classic_part_lookup(avrprog_t *ap)
+{
+  const struct avr_classic_part *part;
+  unsigned char sig[3];
+  int i;
+
+  for(i = 0; i < 3; i++) sig[i] = avr_read_signature(ap, i);
+  part = avr_classic_part_find(sig);
+  if(part) return part;
+  avr_info(ap, "Unknown classic AVR signature %02x %02x %02x, data polling disabled.\n", sig[0], sig[1], sig[2]);
+  return &avr_classic_unknown;
+}
+
+/* Assumes a previous chip erase: 0xff bytes are not written. */
+static int avr_program_classic(avrprog_t *ap, const struct avr_classic_part *part,
+    const unsigned char *flash, int length, bool verify) /* must have been powered-up */
+{
+  int i;
+  int written;
+  long long t0;
+
+  avr_info(ap, "Part is %s, flash size %d bytes.\n", part->name, part->flash_size);
+  avr_info(ap, "Code length is %d (0x%x) bytes.\n", length, length);
+  if(length > part->flash_size) {
+    avr_error(ap, "Error: Program size exceeds flash size\n");
+    return AVRPROG_ERR_SIZE;
+  }
+
+  t0 = now_us();
+  written = 0;
+  for(i = 0; i < length; i++) {
+    if(flash[i] == 0xff) continue;
+    avr_progress(ap, AVRPROG_PHASE_PROGRAM, i, length);
+    if(!avr_write_program_byte(ap, part, i, flash[i])) {
+      avr_error(ap, "Error, aborting.\n");
+      return avr_status(ap, AVRPROG_ERR_WRITE);
+    }
+    written ++;
+  }
+  avr_progress(ap, AVRPROG_PHASE_PROGRAM, length, length);
+  avr_info(ap, "Wrote %d byte(s), skipped %d 0xff byte(s) in %lld ms.\n",
+      written, length - written, (now_us() - t0) / 1000);
+
+  if(verify) {
+    avr_info(ap, "Verifying...\n");
+    if(avr_verify_program_memory(ap, flash, 0, length)) return avr_status(ap, AVRPROG_ERR_VERIFY);
+  }
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_program_classic(avrprog_t *ap, const unsigned char *flash, int length, bool verify)
+{
+  return avr_program_classic(ap, avr_classic_part_lookup(ap), flash, length, verify);
+}
+
+enum
+{
+  AVR_LXAB    = 0x4d,
+  AVR_LPMP_LO = 0x40,
+  AVR_LPMP_HI = 0x48,
+  AVR_WPMP    = 0x4c,
+  AVR_RPMP_LO = 0x20,
+  AVR_RPMP_HI = 0x28,
+};
+
+/* Flash and page size (in words) from the second signature byte */
+static int avr_mega_geometry(unsigned char flash_code, unsigned int *flash_size, unsigned int *page_size)
+{
+  switch(flash_code)
+  {
+    case 0x92:
+      *flash_size = 4096;
+      *page_size = 32;
+      break;
+    case 0x93:
+      *flash_size = 8192;
+      *page_size = 32;
+      break;
+    case 0x94:
+      *flash_size = 16384;
+      *page_size = 64;
+      break;
+    case 0x95:
+      *flash_size = 32768;
+      *page_size = 64;
+      break;
+    case 0x96:
+      *flash_size = 65536;
+      *page_size = 128;
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+static int avr_verify_page(avrprog_t *ap, const unsigned char *flash, int page_size, int j)
+{
+  int i;
+  int byte_index;
+  unsigned char x1, x2;
+
+  for(i = 0; i < 2 * page_size; i ++) {
+    byte_index = 2 * page_size * j + i;
+    x1 = flash[byte_index];
+    x2 = avr_talk(ap, (byte_index & 1) ? AVR_RPMP_HI : AVR_RPMP_LO,
+        0xff & (byte_index >> 9), (byte_index >> 1) & 0xff, 0x00);
+    if(x1 != x2) {
+      avr_error(ap, "ERROR: At index %d byte 0x%02x reads back as 0x%02x.\n", byte_index, x1, x2);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Whether page j can be written without an erase: it reads back either
+ * as the image or as all-FF */
+static int avr_page_writable(avrprog_t *ap, const unsigned char *flash, int page_size, int j)
+{
+  int i;
+  int byte_index;
+  bool match, blank;
+  unsigned char x;
+
+  match = blank = true;
+  for(i = 0; i < 2 * page_size && (match || blank); i ++) {
+    byte_index = 2 * page_size * j + i;
+    x = avr_talk(ap, (byte_index & 1) ? AVR_RPMP_HI : AVR_RPMP_LO,
+        0xff & (byte_index >> 9), (byte_index >> 1) & 0xff, 0x00);
+    if(x != flash[byte_index]) match = false;
+    if(x != 0xff) blank = false;
+  }
+  return match || blank;
+}
+
+/* Resume journal: a header line identifying the target and the image,
+ * then one line per page that has been written and verified (or was
+ * skipped as all-FF), flushed to disk as it is appended. */
+#define JOURNAL_HEADER "avrprogni-journal sig=%02x%02x%02x image=%08lx length=%d page_size=%d\n"
+
+/* FNV-1a */
+unsigned long avrprog_hash(const unsigned char *p, int n)
+{
+  unsigned long h;
+
+  h = 2166136261UL;
+  while(n--) {
+    h ^= *p++;
+    h = (h * 16777619UL) & 0xffffffffUL;
+  }
+  return h;
+}
+
+static FILE *journal_create(avrprog_t *ap, const unsigned char *sig, const unsigned char *flash, int length, int page_size)
+{
+  FILE *f;
+
+  f = fopen(ap->journal, "w");
+  if(!f) {
+    avr_error(ap, "Can't create journal %s.\n", ap->journal);
+    return NULL;
+  }
+  fprintf(f, JOURNAL_HEADER, sig[0], sig[1], sig[2], avrprog_hash(flash, length), length, page_size);
+  fflush(f);
+  return f;
+}
+
+/* Marks journaled pages in done[] and returns their count, or -1 if
+ * there is no journal for this target and image. */
+static int journal_read(avrprog_t *ap, const unsigned char *sig, const unsigned char *flash, int length, int page_size,
+    unsigned char *done, int pages)
+{
+  FILE *f;
+  char line[128], header[128];
+  int j, count;
+
+  f = fopen(ap->journal, "r");
+  if(!f) return -1;
+
+  snprintf(header, sizeof(header), JOURNAL_HEADER, sig[0], sig[1], sig[2], avrprog_hash(flash, length), length, page_size);
+  if(!fgets(line, sizeof(line), f) || strcmp(line, header)) {
+    avr_info(ap, "Journal %s is for another target or image, ignoring it.\n", ap->journal);
+    fclose(f);
+    return -1;
+  }
+
+  count = 0;
+  while(fgets(line, sizeof(line), f)) {
+    if(1 == sscanf(line, "page %d", &j) && 0 <= j && j < pages && !done[j]) {
+      done[j] = 1;
+      count ++;
+    }
+  }
+  fclose(f);
+  return count;
+}
+
+static void journal_page(FILE *f, int j)
+{
+  fprintf(f, "page %d\n", j);
+  fflush(f);
+  fsync(fileno(f));
+}
+
+/* ISP frames loading page j and writing it; 4 * (2 * page_size + 1)
+ * bytes (page_size in words) */
+static void avr_page_frames(unsigned char *f, const unsigned char *flash, int page_size, int j)
+{
+  int i;
+  int byte_index;
+
+  for(i = 0; i < page_size; i++) {
+    byte_index = 2 * (page_size * j + i);
+    f[0] = AVR_LPMP_LO; f[1] = 0x00; f[2] = i; f[3] = flash[byte_index];
+    f[4] = AVR_LPMP_HI; f[5] = 0x00; f[6] = i; f[7] = flash[byte_index + 1];
+    f += 8;
+  }
+  f[0] = AVR_WPMP; f[1] = (j * page_size) >> 8; f[2] = (j * page_size) & 0xff; f[3] = 0x00;
+}
+
+/* Index of the byte of page j to poll after writing it (the last one
+ * that isn't 0xff), or -1 if the page is blank and need not be loaded */
+static int avr_page_poll_index(const unsigned char *flash, int page_size, int j, const struct avrprog_image *img)
+{
+  int i;
+  int not_ff;
+
+  not_ff = -1;
+  if(!img || avrprog_image_populated(img, j)) {
+    for(i = 2 * page_size * j; i < 2 * page_size * (j + 1); i++) {
+      if(flash[i] != 0xff) not_ff = i;
+    }
+  }
+  return not_ff;
+}
+
+/* Copy of flash padded with 0xff to whole pages of page_size words, as
+ * avr_program_mega() and the estimate read them */
+static unsigned char *avr_page_pad(const unsigned char *flash, int length, int page_size)
+{
+  unsigned char *p;
+  int n;
+
+  n = ((length + 1) / 2 + page_size - 1) / page_size * 2 * page_size;
+  p = malloc(n > 0 ? n : 1);
+  if(!p) return NULL;
+  memset(p, 0xff, n);
+  memcpy(p, flash, length);
+  return p;
+}
+
+/* program length is in BYTES; pages set in done[] (if not NULL) are
+ * assumed to be programmed already.  With a compiled image, blank pages
+ * come from its bitmap and the ISP frames are sent as stored. */
+static int avr_program_mega(avrprog_t *ap, const unsigned char *flash, int length, int page_size,
+    unsigned char *done, FILE *journal, const struct avrprog_image *img) /* must have been powered-up */
+{
+  int i, j;
+  int pages;
+  int this_length;
+  unsigned char x;
+  int byte_index;
+  int tries;
+  unsigned char x1;
+  int not_ff;
+  char line[2 * 2 * 128 + 8];
+  int o;
+  const unsigned char *f;
+
+  length = (length + 1) / 2; /* length in words */
+  pages = (length + page_size - 1) / page_size;
+  avr_info(ap, "Code length is %d (0x%x) words(s), %d page(s) of %d words.\n", length, length, pages, page_size);
+
+  avr_talk(ap, AVR_LXAB, 0x00, 0x00, 0x00);
+
+  for(j = 0; j < pages; j ++) {
+    this_length = page_size;
+    avr_progress(ap, AVRPROG_PHASE_PROGRAM, j, pages);
+
+    if(done && done[j]) continue;
+
+    /* don't load pages that would be left erased */
+    not_ff = avr_page_poll_index(flash, page_size, j, img);
+    if(not_ff < 0) {
+      avr_info(ap, "\nSkipping page %d (all-FF).\n", j);
+      if(journal) journal_page(journal, j);
+      continue;
+    }
+
+    avr_info(ap, "\nProgramming page %d : %d words (words 0x%04x to 0x%04x):\n",
+        j, this_length, j * page_size, (j + 1) * page_size - 1);
+
+    o = sprintf(line, "%04x:", 2 * page_size * j);
+
+    if(img && img->frames) {
+      f = img->frames + j * img->frame_size;
+      for(i = 0; i < 2 * this_length; i++, f += 4) {
+        o += sprintf(line + o, "%02x", f[3]);
+        (void) avr_talk(ap, f[0], f[1], f[2], f[3]);
+      }
+      avr_info(ap, "%s\n", line);
+      avr_info(ap, "\nWriting page %d.\n", j);
+      (void) avr_talk(ap, f[0], f[1], f[2], f[3]);
+    } else {
+      for(i = 0; i < this_length; i++) {
+        byte_index = 2 * (page_size * j + i);
+
+        /* low byte first */
+        x = flash[byte_index];
+        o += sprintf(line + o, "%02x", x);
+        (void) avr_talk(ap, AVR_LPMP_LO, 0x00, i, x);
+
+        x = flash[byte_index + 1];
+        o += sprintf(line + o, "%02x", x);
+        (void) avr_talk(ap, AVR_LPMP_HI, 0x00, i, x);
+      }
+      avr_info(ap, "%s\n", line);
+
+      /* write page */
+      avr_info(ap, "\nWriting page %d.\n", j);
+      (void) avr_talk(ap, AVR_WPMP, (j * page_size) >> 8, (j * page_size) & 0xff, 0x00);
+    }
+
+    /* poll */
+    for(tries = 0; tries < 10000; tries ++)
+    {
+      if(not_ff & 1)
+        x1 = avr_talk(ap, AVR_RPMP_HI, 0xff & (not_ff >> 9), (not_ff >> 1) & 0xff, 0x00);
+      else
+        x1 = avr_talk(ap, AVR_RPMP_LO, 0xff & (not_ff >> 9), (not_ff >> 1) & 0xff, 0x00);
+
+      if(flash[not_ff] == x1 || ap->io_error) break;
+      udelay(ap, 10);
+    }
+    if(tries == 10000)
+    {
+      avr_error(ap, "ERROR: Polling failed after 1000 tries, not_ff=%d 0x%02x got 0x%02x.\n", not_ff, flash[not_ff], x1);
+      return avr_status(ap, AVRPROG_ERR_WRITE);
+    }
+
+    avr_info(ap, "Verifying: ");
+    if(!avr_verify_page(ap, flash, page_size, j)) return avr_status(ap, AVRPROG_ERR_VERIFY);
+    avr_info(ap, "OK.\n");
+    if(journal) journal_page(journal, j);
+  }
+  avr_progress(ap, AVRPROG_PHASE_PROGRAM, pages, pages);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+static int avr_mega_part(avrprog_t *ap, unsigned int *flash_size, unsigned int *page_size)
+{
+  unsigned char flash_code;
+
+  *flash_size = *page_size = 0;
+  /* Determine flash size */
+  flash_code = avr_read_signature(ap, 0x01);
+  if(!avr_mega_geometry(flash_code, flash_size, page_size))
+  {
+    avr_error(ap, "Unknown flash size code 0x%02x\n", flash_code);
+    return avr_status(ap, AVRPROG_ERR_PART);
+  }
+  avr_info(ap, "Flash size is %d bytes (page size %d)\n", *flash_size, *page_size);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+/* avr_program_mega() with a journal; when resuming, pages journaled by
+ * an interrupted run for the same target and image are verified and
+ * kept instead of erasing the chip again.  The page that was being
+ * written when the run stopped is not journaled; page writes can only
+ * clear bits, so unless it reads back as the image or as all-FF the
+ * chip is erased.  Without a usable journal the chip is erased too. */
+static int avr_program_mega_resumable(avrprog_t *ap, const unsigned char *flash, int length,
+    const unsigned char *sig, int page_size, const struct avrprog_image *img)
+{
+  unsigned char *done;
+  FILE *journal;
+  int pages, count, j;
+  int status;
+  bool restart;
+
+  pages = ((length + 1) / 2 + page_size - 1) / page_size;
+  done = calloc(pages, 1);
+
+  count = ap->resume && ap->journal ? journal_read(ap, sig, flash, length, page_size, done, pages) : -1;
+  restart = false;
+  if(count >= 0) {
+    avr_info(ap, "Resuming: verifying %d journaled page(s).\n", count);
+    for(j = 0; j < pages; j++) {
+      if(done[j] && !avr_verify_page(ap, flash, page_size, j)) {
+        avr_info(ap, "Journaled page %d does not verify, starting over.\n", j);
+        restart = true;
+        break;
+      }
+    }
+  }
+  if(count >= 0 && !restart) {
+    for(j = 0; j < pages && done[j]; j++);
+    if(j < pages && !avr_page_writable(ap, flash, page_size, j)) {
+      avr_info(ap, "Page %d was partly written, starting over.\n", j);
+      restart = true;
+    }
+  }
+  if(ap->resume && (count < 0 || restart)) {
+    if(count < 0) avr_info(ap, "No usable journal, starting over.\n");
+    avr_chip_erase(ap);
+    status = avrprog_powerup(ap);
+    if(status) {
+      free(done);
+      return status;
+    }
+    memset(done, 0, pages);
+    count = -1;
+  }
+
+  if(!ap->journal) {
+    journal = NULL;
+  } else if(count >= 0) {
+    journal = fopen(ap->journal, "a");
+  } else {
+    journal = journal_create(ap, sig, flash, length, page_size);
+  }
+
+  status = avr_program_mega(ap, flash, length, page_size, done, journal, img);
+  if(journal) fclose(journal);
+  free(done);
+  return status;
+}
+
+int avrprog_program_mega(avrprog_t *ap, const unsigned char *flash, int length)
+{
+  unsigned int flash_size, page_size;
+  unsigned char sig[3];
+  unsigned char *padded;
+  int status;
+
+  status = avr_mega_part(ap, &flash_size, &page_size);
+  if(status) return status;
+  if(length > flash_size)
+  {
+    avr_error(ap, "Error: Program size exceeds flash size\n");
+    return AVRPROG_ERR_SIZE;
+  }
+
+  avrprog_read_signature(ap, sig);
+  padded = avr_page_pad(flash, length, page_size);
+  if(!padded) return AVRPROG_ERR_SIZE;
+  status = avr_program_mega_resumable(ap, padded, length, sig, page_size, NULL);
+  free(padded);
+  return status;
+}
+
+/* Compiled image container.  All fields are little-endian; the regions
+ * start at the offsets given in the header, data and frames on 4096-byte
+ * boundaries so that they can be used straight from the mapping.
+ *
+ *    0  magic "AVRPIMG1"
+ *    8  signature (3 bytes), flags (1 byte, IMAGE_FRAMES)
+ *   12  length, page size (bytes), page count
+ *   24  bitmap, hashes, data and frames offsets (frames 0 if absent)
+ *   40  frame size (bytes per page), image hash
+ *   48  reserved, zero
+ *   64  bitmap: bit j of byte j / 8 set if page j is not blank
+ */
+#define IMAGE_MAGIC "AVRPIMG1"
+#define IMAGE_HEADER 64
+#define IMAGE_ALIGN 4096
+#define IMAGE_FRAMES 0x01
+#define IMAGE_CLASSIC_PAGE 64 /* hashing granularity for classic parts */
+
+static inline int image_align(int x, int a)
+{
+  return (x + a - 1) & ~(a - 1);
+}
+
+static inline void put32(unsigned char *p, unsigned long x)
+{
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+
+static inline unsigned long get32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+/* Lays out a container in a malloc()ed buffer; no frames for classic
+ * parts */
+static int image_build(avrprog_t *ap, const unsigned char *flash, int length,
+    const unsigned char *sig, bool frames, unsigned char **bufp, int *sizep)
+{
+  const struct avr_classic_part *part;
+  unsigned int flash_size, page_words;
+  int page_size, pages, frame_size;
+  int hash_offset, data_offset, frames_offset, size;
+  unsigned char *buf, *data;
+  int i, j;
+
+  part = avr_classic_part_find(sig);
+  if(part) {
+    flash_size = part->flash_size;
+    page_size = IMAGE_CLASSIC_PAGE;
+    page_words = 0;
+    frames = false;
+  } else if(sig[0] == 0x1e && avr_mega_geometry(sig[1], &flash_size, &page_words)) {
+    page_size = 2 * page_words;
+  } else {
+    avr_error(ap, "Unknown part %02x %02x %02x\n", sig[0], sig[1], sig[2]);
+    return AVRPROG_ERR_PART;
+  }
+  if(length > flash_size) {
+    avr_error(ap, "Error: Program size exceeds flash size\n");
+    return AVRPROG_ERR_SIZE;
+  }
+
+  pages = (length + page_size - 1) / page_size;
+  frame_size = frames ? 4 * (page_size + 1) : 0;
+  hash_offset = image_align(IMAGE_HEADER + (pages + 7) / 8, 4);
+  data_offset = image_align(hash_offset + 4 * pages, IMAGE_ALIGN);
+  frames_offset = frames ? image_align(data_offset + pages * page_size, IMAGE_ALIGN) : 0;
+  size = frames ? frames_offset + pages * frame_size : data_offset + pages * page_size;
+
+  buf = calloc(size, 1);
+  if(!buf) return AVRPROG_ERR_FILE;
+  data = buf + data_offset;
+  memset(data, 0xff, pages * page_size);
+  memcpy(data, flash, length);
+
+  memcpy(buf, IMAGE_MAGIC, 8);
+  memcpy(buf + 8, sig, 3);
+  buf[11] = frames ? IMAGE_FRAMES : 0;
+  put32(buf + 12, length);
+  put32(buf + 16, page_size);
+  put32(buf + 20, pages);
+  put32(buf + 24, IMAGE_HEADER);
+  put32(buf + 28, hash_offset);
+  put32(buf + 32, data_offset);
+  put32(buf + 36, frames_offset);
+  put32(buf + 40, frame_size);
+  put32(buf + 44, avrprog_hash(data, length));
+
+  for(j = 0; j < pages; j++) {
+    for(i = 0; i < page_size && data[j * page_size + i] == 0xff; i++);
+    if(i < page_size) buf[IMAGE_HEADER + j / 8] |= 1 << (j & 7);
+    put32(buf + hash_offset + 4 * j, avrprog_hash(data + j * page_size, page_size));
+    if(frames) avr_page_frames(buf + frames_offset + j * frame_size, data, page_words, j);
+  }
+
+  *bufp = buf;
+  *sizep = size;
+  return AVRPROG_OK;
+}
+
+int avrprog_image_compile(avrprog_t *ap, const unsigned char *flash, int length,
+    const unsigned char *sig, bool frames, const char *fn)
+{
+  const struct avr_classic_part *part;
+  unsigned char *buf;
+  int size, page_size, pages;
+  int status;
+  FILE *f;
+
+  part = avr_classic_part_find(sig);
+  if(part && frames) {
+    avr_info(ap, "%s has no page buffer, not storing frames.\n", part->name);
+    frames = false;
+  }
+  status = image_build(ap, flash, length, sig, frames, &buf, &size);
+  if(status) return status;
+  page_size = get32(buf + 16);
+  pages = get32(buf + 20);
+
+  f = fopen(fn, "wb");
+  if(!f || fwrite(buf, 1, size, f) != size || fclose(f)) {
+    avr_error(ap, "Can't write image %s.\n", fn);
+    free(buf);
+    return AVRPROG_ERR_FILE;
+  }
+  free(buf);
+  avr_info(ap, "Compiled %d bytes into %d page(s) of %d bytes%s, %d bytes.\n",
+      length, pages, page_size, frames ? " with ISP frames" : "", size);
+  return AVRPROG_OK;
+}
+
+bool avrprog_image_probe(const char *fn)
+{
+  char magic[8];
+  FILE *f;
+  bool ok;
+
+  f = fopen(fn, "rb");
+  if(!f) return false;
+  ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, IMAGE_MAGIC, 8);
+  fclose(f);
+  return ok;
+}
+
+/* Page size of containers for the part, 0 if unknown; *flash_size
+ * gets its flash size in bytes */
+static int image_geometry(const unsigned char *sig, unsigned int *flash_size)
+{
+  const struct avr_classic_part *part;
+  unsigned int page_words;
+
+  *flash_size = 0;
+  part = avr_classic_part_find(sig);
+  if(part) {
+    *flash_size = part->flash_size;
+    return IMAGE_CLASSIC_PAGE;
+  }
+  if(sig[0] == 0x1e && avr_mega_geometry(sig[1], flash_size, &page_words)) return 2 * page_words;
+  return 0;
+}
+
+/* Checks the header of the container at p and points img into it.
+ * Stored ISP frames are sent as they are, so they must be exactly the
+ * ones avr_page_frames() makes from the data: a corrupt opcode could
+ * write the fuses. */
+static int image_parse(avrprog_t *ap, const char *fn, const unsigned char *p, unsigned long size,
+    struct avrprog_image *img)
+{
+  unsigned long bitmap_offset, hash_offset, data_offset, frames_offset;
+  unsigned int flash_size;
+  unsigned char frame[4 * (256 + 1)]; /* largest page, 256 bytes */
+  int j;
+
+  memcpy(img->signature, p + 8, 3);
+  img->length = get32(p + 12);
+  img->page_size = get32(p + 16);
+  img->pages = get32(p + 20);
+  bitmap_offset = get32(p + 24);
+  hash_offset = get32(p + 28);
+  data_offset = get32(p + 32);
+  frames_offset = get32(p + 36);
+  img->frame_size = get32(p + 40);
+  img->hash = get32(p + 44);
+
+  if(memcmp(p, IMAGE_MAGIC, 8) || img->page_size != image_geometry(img->signature, &flash_size) ||
+     img->page_size <= 0 || img->pages <= 0 ||
+     img->pages > flash_size / img->page_size ||
+     img->length > img->pages * img->page_size ||
+     bitmap_offset + (img->pages + 7) / 8 > size ||
+     hash_offset + 4 * img->pages > size ||
+     data_offset + img->pages * img->page_size > size ||
+     ((p[11] & IMAGE_FRAMES) &&
+      (img->frame_size != 4 * (img->page_size + 1) ||
+       frames_offset + img->pages * img->frame_size > size))) {
+    avr_error(ap, "Bad image %s.\n", fn);
+    return AVRPROG_ERR_FILE;
+  }
+  img->bitmap = p + bitmap_offset;
+  img->hashes = p + hash_offset;
+  img->data = p + data_offset;
+  img->frames = (p[11] & IMAGE_FRAMES) ? p + frames_offset : NULL;
+
+  for(j = 0; img->frames && j < img->pages; j++) {
+    avr_page_frames(frame, img->data, img->page_size / 2, j);
+    if(memcmp(frame, img->frames + j * img->frame_size, img->frame_size)) {
+      avr_error(ap, "Bad ISP frames for page %d in image %s.\n", j, fn);
+      return AVRPROG_ERR_FILE;
+    }
+  }
+  return AVRPROG_OK;
+}
+
+int avrprog_image_open(avrprog_t *ap, const char *fn, struct avrprog_image *img)
+{
+  struct stat st;
+  int fd;
+
+  memset(img, 0, sizeof(*img));
+  fd = open(fn, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < IMAGE_HEADER) {
+    avr_error(ap, "Can't open image %s.\n", fn);
+    if(fd >= 0) close(fd);
+    return AVRPROG_ERR_FILE;
+  }
+  img->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(img->map == MAP_FAILED) {
+    img->map = NULL;
+    avr_error(ap, "Can't map image %s.\n", fn);
+    return AVRPROG_ERR_FILE;
+  }
+  img->map_size = st.st_size;
+
+  if(image_parse(ap, fn, img->map, img->map_size, img)) {
+    avrprog_image_close(img);
+    return AVRPROG_ERR_FILE;
+  }
+  return AVRPROG_OK;
+}
+
+void avrprog_image_close(struct avrprog_image *img)
+{
+  if(img->map) munmap(img->map, img->map_size);
+  memset(img, 0, sizeof(*img));
+}
+
+bool avrprog_image_populated(const struct avrprog_image *img, int j)
+{
+  return img->bitmap[j >> 3] & (1 << (j & 7));
+}
+
+unsigned long avrprog_image_page_hash(const struct avrprog_image *img, int j)
+{
+  return get32(img->hashes + 4 * j);
+}
+
+int avrprog_image_check(avrprog_t *ap, const struct avrprog_image *img)
+{
+  unsigned char sig[3];
+
+  avrprog_read_signature(ap, sig);
+  if(memcmp(sig, img->signature, 3)) {
+    avr_error(ap, "ERROR: Image is for %02x %02x %02x, target is %02x %02x %02x.\n",
+        img->signature[0], img->signature[1], img->signature[2], sig[0], sig[1], sig[2]);
+    return avr_status(ap, AVRPROG_ERR_PART);
+  }
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_program_image(avrprog_t *ap, const struct avrprog_image *img)
+{
+  const struct avr_classic_part *part;
+  int status;
+
+  status = avrprog_image_check(ap, img);
+  if(status) return status;
+  part = avr_classic_part_find(img->signature);
+  if(part) return avr_program_classic(ap, part, img->data, img->length, true);
+  return avr_program_mega_resumable(ap, img->data, img->length, img->signature, img->page_size / 2, img);
+}
+
+int avrprog_verify_image(avrprog_t *ap, const struct avrprog_image *img, int *errors)
+{
+  unsigned char *buf;
+  int j, n;
+  int status;
+
+  status = avrprog_image_check(ap, img);
+  if(status) return status;
+  buf = malloc(img->page_size);
+  n = 0;
+  for(j = 0; j < img->pages && !status; j++) {
+    status = avrprog_read_flash(ap, j * img->page_size, img->page_size, buf);
+    if(!status && avrprog_hash(buf, img->page_size) != avrprog_image_page_hash(img, j)) {
+      avr_error(ap, "ERROR: Page %d (0x%04x) does not match image\n", j, j * img->page_size);
+      n ++;
+    }
+    avr_progress(ap, AVRPROG_PHASE_VERIFY, j + 1, img->pages);
+  }
+  free(buf);
+  if(status) return status;
+
+  if(errors) *errors = n;
+  if(!n) avr_info(ap, "No errors.\n");
+  else
+  {
+    avr_error(ap, "ERRORS: Erroneous page count is %d\n", n);
+  }
+  return n ? AVRPROG_ERR_VERIFY : AVRPROG_OK;
+}
+
+/* Packed image format, shared with avrstub.c.  A stream of tokens: the
+ * top two bits of a token byte give its type, the low six bits a length
+ * code c.  The length is c + minimum for c < 63; for c = 63 the length
+ * follows as a 16-bit little-endian word.
+ *
+ *   00  literal  min 1  the bytes follow
+ *   01  run      min 3  one byte follows, repeated
+ *   10  copy     min 4  16-bit LE distance follows; repeats the output
+ *                       from that many bytes back
+ *   11  end of stream
+ */
+enum
+{
+  PACK_LITERAL = 0x00,
+  PACK_RUN     = 0x40,
+  PACK_COPY    = 0x80,
+  PACK_END     = 0xc0,
+};
+
+#define PACK_WINDOW 4096
+#define PACK_MAX_LENGTH 65535
+
+static inline int pack_min(int type)
+{
+  return type == PACK_LITERAL ? 1 : type == PACK_RUN ? 3 : 4;
+}
+
+static int pack_token(unsigned char *out, int o, int type, int len)
+{
+  if(len - pack_min(type) < 63) {
+    out[o++] = type | (len - pack_min(type));
+  } else {
+    out[o++] = type | 63;
+    out[o++] = len & 0xff;
+    out[o++] = len >> 8;
+  }
+  return o;
+}
+
+static int pack_literals(unsigned char *out, int o, const unsigned char *in, int from, int to)
+{
+  if(from < to) {
+    o = pack_token(out, o, PACK_LITERAL, to - from);
+    memcpy(out + o, in + from, to - from);
+    o += to - from;
+  }
+  return o;
+}
+
+/* Greedy compression */
+int avrprog_pack(const unsigned char *in, int n, unsigned char *out)
+{
+  int i, j, l;
+  int o;
+  int lit;
+  int run, best, dist;
+
+  o = 0;
+  lit = 0;
+  for(i = 0; i < n; ) {
+    for(run = 1; i + run < n && run < PACK_MAX_LENGTH && in[i + run] == in[i]; run ++);
+
+    best = 0;
+    dist = 0;
+    if(run < 3) {
+      for(j = i - 1; j >= 0 && i - j <= PACK_WINDOW && best < PACK_MAX_LENGTH; j --) {
+        for(l = 0; i + l < n && l < PACK_MAX_LENGTH && in[j + l] == in[i + l]; l ++);
+        if(l > best) {
+          best = l;
+          dist = i - j;
+        }
+      }
+    }
+
+    if(run >= 3) {
+      o = pack_literals(out, o, in, lit, i);
+      o = pack_token(out, o, PACK_RUN, run);
+      out[o++] = in[i];
+      i += run;
+      lit = i;
+    } else if(best >= 4) {
+      o = pack_literals(out, o, in, lit, i);
+      o = pack_token(out, o, PACK_COPY, best);
+      out[o++] = dist & 0xff;
+      out[o++] = dist >> 8;
+      i += best;
+      lit = i;
+    } else {
+      i ++;
+      if(i - lit == PACK_MAX_LENGTH) {
+        o = pack_literals(out, o, in, lit, i);
+        lit = i;
+      }
+    }
+  }
+  o = pack_literals(out, o, in, lit, n);
+  out[o++] = PACK_END;
+  return o;
+}
+
+/* Reference model of the stub's decompressor.  Returns the unpacked
+ * length, or -1 if the stream is malformed or overflows out. */
+int avrprog_unpack(const unsigned char *in, int n, unsigned char *out, int m)
+{
+  int i, o;
+  int type, len, dist;
+
+  for(i = 0, o = 0; i < n; ) {
+    type = in[i] & 0xc0;
+    len = in[i] & 0x3f;
+    i ++;
+    if(type == PACK_END) return o;
+    if(len == 63) {
+      if(i + 2 > n) return -1;
+      len = in[i] | (in[i + 1] << 8);
+      i += 2;
+    } else len += pack_min(type);
+    if(o + len > m) return -1;
+
+    switch(type) {
+      case PACK_LITERAL:
+        if(i + len > n) return -1;
+        memcpy(out + o, in + i, len);
+        i += len;
+        o += len;
+        break;
+      case PACK_RUN:
+        if(i + 1 > n) return -1;
+        memset(out + o, in[i], len);
+        i ++;
+        o += len;
+        break;
+      case PACK_COPY:
+        if(i + 2 > n) return -1;
+        dist = in[i] | (in[i + 1] << 8);
+        i += 2;
+        if(dist == 0 || dist > o) return -1;
+        for(; len > 0; len --, o ++) out[o] = out[o - dist];
+        break;
+    }
+  }
+  return -1;
+}
+
+/* CRC-16 as computed by avr-libc's _crc16_update() */
+unsigned short avrprog_crc16(unsigned short crc, const unsigned char *p, int n)
+{
+  int i;
+
+  while(n--) {
+    crc ^= *p++;
+    for(i = 0; i < 8; i++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : (crc >> 1);
+  }
+  return crc;
+}
+
+/* Stub loader protocol, see avrstub.c.  With RST released and SCK held
+ * high the stub raises MISO; the host then lowers SCK and the stub drops
+ * MISO when ready.  Bytes are exchanged MSB first, sampled on the rising
+ * edge of SCK.  After a command MISO stays high while the stub is busy;
+ * when it goes low the host clocks one dummy byte, then the reply.
+ *
+ *   'S'                -> page size (16 LE), stub start address (16 LE)
+ *   'B' n data[n]      -> status (0 = ok)
+ *   'C' length(16 LE)  -> CRC-16 of flash [0, length) (16 LE)
+ *   'Q'                   no reply; the stub jumps to address 0
+ */
+#define STUB_BLOCK 128
+#define STUB_TIMEOUT 2000000 /* us */
+
+static unsigned char stub_byte(avrprog_t *ap, unsigned char x)
+{
+  unsigned i;
+  unsigned char z, res;
+
+  res = 0;
+  for(i = 0; i<8; i++) {
+    if(x & 0x80) {
+      (void) avr_rxtx(ap, AVR_RST|AVR_MOSI);
+      avr_delay(ap);
+      z = avr_rxtx(ap, AVR_RST|AVR_MOSI|AVR_SCLK);
+      avr_delay(ap);
+    } else {
+      (void) avr_rxtx(ap, AVR_RST);
+      avr_delay(ap);
+      z = avr_rxtx(ap, AVR_RST|AVR_SCLK);
+      avr_delay(ap);
+    }
+    res <<= 1;
+    if (z) res |= 1;
+    x = (x << 1) & 0xff;
+  }
+  (void) avr_rxtx(ap, AVR_RST);
+
+  return res;
+}
+
+static int stub_wait(avrprog_t *ap, bool miso)
+{
+  long long deadline;
+
+  deadline = now_us() + STUB_TIMEOUT;
+  while(rx_miso(ap) != miso) {
+    if(now_us() > deadline || ap->io_error) {
+      avr_error(ap, "ERROR: Stub loader not responding.\n");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int stub_reply(avrprog_t *ap, unsigned char *r, int n)
+{
+  int i;
+
+  if(!stub_wait(ap, false)) return 0;
+  (void) stub_byte(ap, 0x00);
+  for(i = 0; i < n; i++) r[i] = stub_byte(ap, 0x00);
+  return 1;
+}
+
+/* Stream the image through a stub loader that has already been
+ * ISP-programmed into the boot section.  Leaves programming mode. */
+static int stub_program(avrprog_t *ap, const unsigned char *flash, int length)
+{
+  unsigned char r[4];
+  unsigned char *packed;
+  int page_size, stub_start;
+  int n, o, b, i;
+  unsigned short crc;
+  long long t0;
+
+  avr_info(ap, "Starting stub loader.\n");
+  tx(ap, AVR_RST|AVR_SCLK);
+  if(!stub_wait(ap, true)) return avr_status(ap, AVRPROG_ERR_STUB);
+  tx(ap, AVR_RST);
+  if(!stub_wait(ap, false)) return avr_status(ap, AVRPROG_ERR_STUB);
+
+  (void) stub_byte(ap, 'S');
+  if(!stub_reply(ap, r, 4)) return avr_status(ap, AVRPROG_ERR_STUB);
+  page_size = r[0] | (r[1] << 8);
+  stub_start = r[2] | (r[3] << 8);
+  avr_info(ap, "Stub at 0x%04x, page size %d bytes.\n", stub_start, page_size);
+  if(length > stub_start) {
+    avr_error(ap, "ERROR: Program overlaps the stub loader.\n");
+    return AVRPROG_ERR_SIZE;
+  }
+
+  packed = malloc(length + length / 32 + 4);
+  n = avrprog_pack(flash, length, packed);
+  avr_info(ap, "Packed %d bytes into %d (%.1f%%).\n", length, n, 100.0 * n / (length ? length : 1));
+
+  t0 = now_us();
+  for(o = 0; o < n; o += b) {
+    b = n - o < STUB_BLOCK ? n - o : STUB_BLOCK;
+    avr_progress(ap, AVRPROG_PHASE_STREAM, o, n);
+    (void) stub_byte(ap, 'B');
+    (void) stub_byte(ap, b);
+    for(i = 0; i < b; i++) (void) stub_byte(ap, packed[o + i]);
+    if(!stub_reply(ap, r, 1)) {
+      free(packed);
+      return avr_status(ap, AVRPROG_ERR_STUB);
+    }
+    if(r[0]) {
+      avr_error(ap, "ERROR: Stub loader reports error %d at offset 0x%04x.\n", r[0], o);
+      free(packed);
+      return avr_status(ap, AVRPROG_ERR_STUB);
+    }
+  }
+  free(packed);
+  avr_progress(ap, AVRPROG_PHASE_STREAM, n, n);
+  avr_info(ap, "Sent in %lld ms.\n", (now_us() - t0) / 1000);
+
+  (void) stub_byte(ap, 'C');
+  (void) stub_byte(ap, length & 0xff);
+  (void) stub_byte(ap, length >> 8);
+  if(!stub_reply(ap, r, 2)) return avr_status(ap, AVRPROG_ERR_STUB);
+  crc = avrprog_crc16(0xffff, flash, length);
+  if((r[0] | (r[1] << 8)) != crc) {
+    avr_error(ap, "ERROR: Target CRC 0x%04x, expected 0x%04x.\n", r[0] | (r[1] << 8), crc);
+    return avr_status(ap, AVRPROG_ERR_VERIFY);
+  }
+  avr_info(ap, "CRC 0x%04x OK.\n", crc);
+
+  (void) stub_byte(ap, 'Q');
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_stub_program(avrprog_t *ap, const unsigned char *stub, int stub_length,
+    const unsigned char *flash, int length)
+{
+  unsigned int flash_size, page_size;
+  unsigned char *padded;
+  int status;
+
+  status = avr_mega_part(ap, &flash_size, &page_size);
+  if(status) return status;
+  if(stub_length > flash_size) {
+    avr_error(ap, "Error: Stub size exceeds flash size\n");
+    return AVRPROG_ERR_SIZE;
+  }
+  avr_chip_erase_wait(ap, ERASE_TIME_MEGA);
+  status = avrprog_powerup(ap);
+  if(status) return status;
+  padded = avr_page_pad(stub, stub_length, page_size);
+  if(!padded) return AVRPROG_ERR_SIZE;
+  status = avr_program_mega(ap, padded, stub_length, page_size, NULL, NULL, NULL);
+  free(padded);
+  if(status) return status;
+  return stub_program(ap, flash, length);
+}
+
+/* Cost model.  The estimate walks the image the way avr_program_mega(),
+ * avr_program_classic() and avrprog_stub_program() do and charges each
+ * ISP instruction, stub byte and wait with the measured DIO latencies.
+ * Write and erase times are datasheet values; the chip itself is not
+ * accessed. */
+#define MEGA_WRITE_TIME 4500    /* us, tWD_FLASH */
+#define CLASSIC_WRITE_TIME 4000 /* us */
+#define TIMING_CALLS 2000
+
+static double timing_loop(avrprog_t *ap, int which)
+{
+  unsigned int x;
+  long long t0;
+  int i;
+
+  t0 = now_us();
+  for(i = 0; i < TIMING_CALLS; i++) {
+    switch(which) {
+      case 0: tx(ap, 0); break;
+      case 1: (void) rx_miso(ap); break;
+      case 2:
+        x = 0;
+        if(comedi_dio_bitfield2(ap->dev, ap->subdev, AVR_OUTBITS, &x, AVR_FIRST_OUTPUT_BIT) < 0)
+          ap->io_error = true;
+        break;
+    }
+  }
+  return (double) (now_us() - t0) / TIMING_CALLS;
+}
+
+int avrprog_measure_timing(avrprog_t *ap, struct avrprog_timing *t)
+{
+  long long t0;
+  int i;
+  bool slow;
+
+  t->tx = timing_loop(ap, 0);
+  t->rx = timing_loop(ap, 1);
+  t->txrx = timing_loop(ap, 2);
+
+  slow = ap->slow;
+  ap->slow = false;
+  t0 = now_us();
+  for(i = 0; i < TIMING_CALLS / 10; i++) udelay(ap, 10);
+  ap->slow = slow;
+  t->sleep = (double) (now_us() - t0) / (TIMING_CALLS / 10) - 10;
+  t->settle_reads = ap->settle_reads;
+  return avr_status(ap, AVRPROG_OK);
+}
+
+/* Time actually spent in udelay(ap, us) */
+static inline double timing_sleep(avrprog_t *ap, const struct avrprog_timing *t, double us)
+{
+  return (ap->slow ? 10 : 1) * us + t->sleep;
+}
+
+/* One byte over the ISP pins as avr_byte() and stub_byte() send it:
+ * 17 line updates, each followed by a MISO read unless batched */
+static double timing_byte(avrprog_t *ap, const struct avrprog_timing *t, enum avrprog_transport transport)
+{
+  double b;
+
+  b = 17 * (transport == AVRPROG_BATCHED && !ap->slow ? t->txrx : t->tx + t->settle_reads * t->rx);
+  if(ap->slow) b += (17 + 16) * timing_sleep(ap, t, 20);
+  return b;
+}
+
+/* Number of readbacks until a write taking w us is seen complete, each
+ * costing c us plus a sleep of s us */
+static inline long timing_polls(double w, double c, double s)
+{
+  return (long) (w / (c + s)) + 1;
+}
+
+/* Pages of flash that avr_program_mega() writes, -1 if out of memory */
+static int estimate_written(const unsigned char *flash, int length, int page_size)
+{
+  unsigned char *padded;
+  int j, pages, n;
+
+  padded = avr_page_pad(flash, length, page_size);
+  if(!padded) return -1;
+  pages = ((length + 1) / 2 + page_size - 1) / page_size;
+  n = 0;
+  for(j = 0; j < pages; j++) {
+    if(avr_page_poll_index(padded, page_size, j, NULL) >= 0) n ++;
+  }
+  free(padded);
+  return n;
+}
+
+/* avr_program_mega() writing n pages of page_size words, each ISP
+ * instruction taking ti us */
+static void estimate_mega(avrprog_t *ap, const struct avrprog_timing *t, double ti,
+    int page_size, int n, struct avrprog_estimate *e)
+{
+  double s, w;
+  long polls;
+  int j;
+
+  e->instructions = 1;
+  s = timing_sleep(ap, t, 10);
+  w = 0;
+  for(j = 0; j < n; j++) {
+    e->instructions += 2 * page_size + 1;
+    polls = timing_polls(MEGA_WRITE_TIME, ti, s);
+    e->polls += polls;
+    e->instructions += polls;
+    e->poll_wait += (polls - 1) * s;
+    w += 2 * page_size;
+  }
+  e->program_time = e->instructions * ti + e->poll_wait;
+  e->instructions += w;
+  e->verify_time = w * ti;
+  e->wire_bits = 32LL * e->instructions;
+}
+
+int avrprog_estimate(avrprog_t *ap, const struct avrprog_timing *t, enum avrprog_transport transport,
+    const unsigned char *sig, const unsigned char *flash, int length,
+    const unsigned char *stub, int stub_length, struct avrprog_estimate *e)
+{
+  const struct avr_classic_part *part;
+  struct avrprog_estimate se;
+  unsigned int flash_size, page_size;
+  double ti, tb;
+  long polls;
+  unsigned char *packed;
+  int i, n, b;
+
+  memset(e, 0, sizeof(*e));
+  tb = timing_byte(ap, t, transport == AVRPROG_STREAMED ? ap->transport : transport);
+  ti = 4 * tb;
+
+  part = avr_classic_part_find(sig);
+  if(part) {
+    if(transport == AVRPROG_STREAMED) return AVRPROG_ERR_PART;
+    if(length > part->flash_size) return AVRPROG_ERR_SIZE;
+    e->erase_wait = timing_sleep(ap, t, ERASE_TIME_CLASSIC);
+    for(i = 0; i < length; i++) {
+      if(flash[i] == 0xff) continue;
+      e->bytes_written ++;
+      e->instructions ++;
+      if(!avr_classic_pollable(part, flash[i])) {
+        e->poll_wait += timing_sleep(ap, t, part->max_write_delay);
+      } else {
+        polls = timing_polls(CLASSIC_WRITE_TIME, ti, 0);
+        e->polls += polls;
+        e->instructions += polls;
+      }
+    }
+    e->program_time = e->instructions * ti + e->poll_wait;
+    n = (length + 1) & ~1;
+    e->instructions += n;
+    e->verify_time = n * ti;
+    e->wire_bits = 32LL * e->instructions;
+    return AVRPROG_OK;
+  }
+
+  if(sig[0] != 0x1e || !avr_mega_geometry(sig[1], &flash_size, &page_size)) return AVRPROG_ERR_PART;
+  if(length > flash_size) return AVRPROG_ERR_SIZE;
+  e->erase_wait = timing_sleep(ap, t, ERASE_TIME_MEGA);
+  e->pages = ((length + 1) / 2 + page_size - 1) / page_size;
+  e->pages_written = estimate_written(flash, length, page_size);
+  if(e->pages_written < 0) return AVRPROG_ERR_SIZE;
+
+  if(transport != AVRPROG_STREAMED) {
+    /* as avr_program_mega() */
+    estimate_mega(ap, t, ti, page_size, e->pages_written, e);
+    return AVRPROG_OK;
+  }
+
+  /* as avrprog_stub_program(): powerup after the erase, ISP upload of
+   * the stub, then the packed image */
+  if(!stub) return AVRPROG_ERR_STUB;
+  if(stub_length > flash_size) return AVRPROG_ERR_SIZE;
+  memset(&se, 0, sizeof(se));
+  n = estimate_written(stub, stub_length, page_size);
+  if(n < 0) return AVRPROG_ERR_SIZE;
+  estimate_mega(ap, t, ti, page_size, n, &se);
+
+  packed = malloc(length + length / 32 + 4);
+  n = avrprog_pack(flash, length, packed);
+  free(packed);
+  b = 1 + 1 + 4; /* 'S', dummy, reply */
+  for(i = 0; i < n; i += STUB_BLOCK) {
+    b += 2 + (n - i < STUB_BLOCK ? n - i : STUB_BLOCK) + 2;
+  }
+  b += 1; /* 'Q' */
+  e->instructions = 1 + se.instructions; /* programming enable */
+  e->polls = se.polls;
+  e->poll_wait = se.poll_wait + e->pages_written * MEGA_WRITE_TIME;
+  e->program_time = timing_sleep(ap, t, 100) + timing_sleep(ap, t, 1000) + timing_sleep(ap, t, 20000) +
+      ti + se.program_time + se.verify_time + b * tb + e->pages_written * MEGA_WRITE_TIME;
+  e->verify_time = (3 + 1 + 2) * tb; /* 'C' */
+  e->wire_bits = 32 + se.wire_bits + 8LL * (b + 3 + 1 + 2);
+  return AVRPROG_OK;
+}
+
+/* Link characterization.  Latency distributions of the three DIO calls
+ * the transports are built from, sustained line update rates, udelay()
+ * jitter and, with RST looped back to MISO (no target), how many MISO
+ * reads it takes for a write to show and whether a combined
+ * write/read call already sees it.  Only MOSI and RST are toggled, SCK
+ * stays low. */
+#define CHARACTERIZE_SAMPLES 10000
+#define CHARACTERIZE_RATE_TIME 250000 /* us per rate measurement */
+#define CHARACTERIZE_TRIALS 200
+#define CHARACTERIZE_MAX_READS 1000
+#define PROFILE_MAGIC "avrprogni-profile 1\n"
+
+static inline long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void stats(struct avrprog_stats *st, double *v, int n)
+{
+  double sum;
+  int i;
+
+  qsort(v, n, sizeof(*v), compare_double);
+  for(sum = 0, i = 0; i < n; i++) sum += v[i];
+  st->mean = sum / n;
+  st->min = v[0];
+  st->median = v[n / 2];
+  st->p99 = v[n * 99 / 100];
+  st->max = v[n - 1];
+}
+
+static void characterize_calls(avrprog_t *ap, int which, struct avrprog_stats *st, double *v)
+{
+  unsigned int x;
+  long long t0;
+  int i;
+
+  for(i = 0; i < CHARACTERIZE_SAMPLES; i++) {
+    x = (i & 1) ? AVR_MOSI : 0;
+    t0 = now_ns();
+    switch(which) {
+      case 0: tx(ap, x); break;
+      case 1: (void) rx_miso(ap); break;
+      case 2:
+        if(comedi_dio_bitfield2(ap->dev, ap->subdev, AVR_OUTBITS, &x, AVR_FIRST_OUTPUT_BIT) < 0)
+          ap->io_error = true;
+        break;
+    }
+    v[i] = (now_ns() - t0) / 1e3;
+  }
+  stats(st, v, CHARACTERIZE_SAMPLES);
+}
+
+/* Line updates per second; tx() alone if settle_reads is 0 */
+static double characterize_rate(avrprog_t *ap, enum avrprog_transport transport, int settle_reads)
+{
+  enum avrprog_transport saved_transport;
+  int saved_reads;
+  long long t0, t;
+  long n;
+
+  saved_transport = ap->transport;
+  saved_reads = ap->settle_reads;
+  ap->transport = transport;
+  ap->settle_reads = settle_reads;
+  t0 = now_us();
+  n = 0;
+  do {
+    if(settle_reads) (void) avr_rxtx(ap, (n & 1) ? AVR_MOSI : 0);
+    else tx(ap, (n & 1) ? AVR_MOSI : 0);
+    n ++;
+  } while((t = now_us() - t0) < CHARACTERIZE_RATE_TIME && !ap->io_error);
+  ap->transport = saved_transport;
+  ap->settle_reads = saved_reads;
+  return n * 1e6 / t;
+}
+
+/* MISO reads until it shows v, 0 if it doesn't */
+static int characterize_wait(avrprog_t *ap, int v)
+{
+  int reads;
+
+  for(reads = 1; rx_miso(ap) != v; reads ++) {
+    if(reads == CHARACTERIZE_MAX_READS || ap->io_error) return 0;
+  }
+  return reads;
+}
+
+/* Each trial starts from the opposite RST level, settled, and times a
+ * real edge written with tx() until MISO follows. */
+static void characterize_settling(avrprog_t *ap, struct avrprog_profile *p)
+{
+  unsigned int x;
+  long long t0, t;
+  int i, reads, v;
+
+  p->loopback = true;
+  p->batched_ok = true;
+  p->settle_reads = 0;
+  p->settle_time = 0;
+  for(i = 0; i < CHARACTERIZE_TRIALS && p->loopback; i++) {
+    v = i & 1;
+    tx(ap, v ? 0 : AVR_RST);
+    if(!characterize_wait(ap, !v)) {
+      p->loopback = false;
+      break;
+    }
+    t0 = now_ns();
+    tx(ap, v ? AVR_RST : 0);
+    reads = characterize_wait(ap, v);
+    t = now_ns() - t0;
+    if(!reads) {
+      p->loopback = false;
+      break;
+    }
+    if(reads > p->settle_reads) p->settle_reads = reads;
+    if(t / 1e3 > p->settle_time) p->settle_time = t / 1e3;
+  }
+
+  /* a combined call must read back the edge it writes */
+  for(i = 0; i < CHARACTERIZE_TRIALS && p->loopback && p->batched_ok; i++) {
+    v = i & 1;
+    tx(ap, v ? 0 : AVR_RST);
+    if(!characterize_wait(ap, !v)) {
+      p->loopback = false;
+      break;
+    }
+    x = v ? AVR_RST : 0;
+    if(comedi_dio_bitfield2(ap->dev, ap->subdev, AVR_OUTBITS, &x, AVR_FIRST_OUTPUT_BIT) < 0)
+      ap->io_error = true;
+    if(((x >> (AVR_MISO_BIT - AVR_FIRST_OUTPUT_BIT)) & 1) != v) p->batched_ok = false;
+  }
+  if(!p->loopback) {
+    p->batched_ok = false;
+    p->settle_reads = 1;
+    p->settle_time = 0;
+  }
+  tx(ap, 0);
+}
+
+int avrprog_characterize(avrprog_t *ap, struct avrprog_profile *p)
+{
+  static const int delays[3] = { 10, 100, 1000 };
+  double *v;
+  long long t0;
+  bool slow;
+  int i, j;
+
+  memset(p, 0, sizeof(*p));
+  v = malloc(CHARACTERIZE_SAMPLES * sizeof(*v));
+  slow = ap->slow;
+  ap->slow = false;
+
+  avr_info(ap, "Measuring call latencies.\n");
+  characterize_calls(ap, 0, &p->tx, v);
+  characterize_calls(ap, 1, &p->rx, v);
+  characterize_calls(ap, 2, &p->txrx, v);
+
+  avr_info(ap, "Measuring udelay() jitter.\n");
+  for(j = 0; j < 3; j++) {
+    for(i = 0; i < CHARACTERIZE_TRIALS; i++) {
+      t0 = now_ns();
+      udelay(ap, delays[j]);
+      v[i] = (now_ns() - t0) / 1e3 - delays[j];
+    }
+    stats(&p->sleep[j], v, CHARACTERIZE_TRIALS);
+  }
+  free(v);
+
+  avr_info(ap, "Measuring read-after-write settling (RST looped back to MISO).\n");
+  characterize_settling(ap, p);
+
+  avr_info(ap, "Measuring update rates.\n");
+  p->tx_rate = characterize_rate(ap, AVRPROG_PER_BIT, 0);
+  p->per_bit_rate = characterize_rate(ap, AVRPROG_PER_BIT, p->settle_reads);
+  p->batched_rate = characterize_rate(ap, AVRPROG_BATCHED, 1);
+  ap->slow = slow;
+
+  /* batched is only safe when a write is seen by the read of the same call */
+  p->transport = p->batched_ok && p->batched_rate > p->per_bit_rate ? AVRPROG_BATCHED : AVRPROG_PER_BIT;
+  p->timing.tx = p->tx.mean;
+  p->timing.rx = p->rx.mean;
+  p->timing.txrx = p->txrx.mean;
+  p->timing.sleep = p->sleep[0].mean;
+  p->timing.settle_reads = p->settle_reads;
+  return avr_status(ap, AVRPROG_OK);
+}
+
+static void profile_stats(FILE *f, const char *name, const struct avrprog_stats *st)
+{
+  fprintf(f, "%s mean=%.3f min=%.3f median=%.3f p99=%.3f max=%.3f\n",
+      name, st->mean, st->min, st->median, st->p99, st->max);
+}
+
+int avrprog_profile_save(avrprog_t *ap, const struct avrprog_profile *p, const char *fn)
+{
+  FILE *f;
+
+  f = fopen(fn, "w");
+  if(!f) {
+    avr_error(ap, "Can't create profile %s.\n", fn);
+    return AVRPROG_ERR_FILE;
+  }
+  fputs(PROFILE_MAGIC, f);
+  fprintf(f, "transport %s\n", p->transport == AVRPROG_BATCHED ? "batched" : "per-bit");
+  fprintf(f, "settle_reads %d\n", p->settle_reads);
+  fprintf(f, "settle_time %.3f\n", p->settle_time);
+  fprintf(f, "loopback %d\n", p->loopback);
+  fprintf(f, "batched_ok %d\n", p->batched_ok);
+  fprintf(f, "tx_rate %.0f\n", p->tx_rate);
+  fprintf(f, "per_bit_rate %.0f\n", p->per_bit_rate);
+  fprintf(f, "batched_rate %.0f\n", p->batched_rate);
+  profile_stats(f, "tx", &p->tx);
+  profile_stats(f, "rx", &p->rx);
+  profile_stats(f, "txrx", &p->txrx);
+  profile_stats(f, "sleep10", &p->sleep[0]);
+  profile_stats(f, "sleep100", &p->sleep[1]);
+  profile_stats(f, "sleep1000", &p->sleep[2]);
+  if(fclose(f)) {
+    avr_error(ap, "Can't write profile %s.\n", fn);
+    return AVRPROG_ERR_FILE;
+  }
+  return AVRPROG_OK;
+}
+
+int avrprog_profile_load(avrprog_t *ap, const char *fn, struct avrprog_profile *p)
+{
+  static const char *stat_names[] = { "tx", "rx", "txrx", "sleep10", "sleep100", "sleep1000" };
+  struct avrprog_stats *stat_fields[] = { &p->tx, &p->rx, &p->txrx, &p->sleep[0], &p->sleep[1], &p->sleep[2] };
+  struct avrprog_stats st;
+  char line[256], name[32], word[32];
+  double d;
+  int i;
+  FILE *f;
+
+  memset(p, 0, sizeof(*p));
+  p->settle_reads = 1;
+  f = fopen(fn, "r");
+  if(!f) {
+    avr_error(ap, "Can't open profile %s.\n", fn);
+    return AVRPROG_ERR_FILE;
+  }
+  if(!fgets(line, sizeof(line), f) || strcmp(line, PROFILE_MAGIC)) {
+    avr_error(ap, "%s is not a profile.\n", fn);
+    fclose(f);
+    return AVRPROG_ERR_FILE;
+  }
+  while(fgets(line, sizeof(line), f)) {
+    if(6 == sscanf(line, "%31s mean=%lf min=%lf median=%lf p99=%lf max=%lf",
+          name, &st.mean, &st.min, &st.median, &st.p99, &st.max)) {
+      for(i = 0; i < 6; i++) {
+        if(!strcmp(name, stat_names[i])) *stat_fields[i] = st;
+      }
+    } else if(1 == sscanf(line, "transport %31s", word)) {
+      p->transport = strcmp(word, "batched") ? AVRPROG_PER_BIT : AVRPROG_BATCHED;
+    } else if(2 == sscanf(line, "%31s %lf", name, &d)) {
+      if(!strcmp(name, "settle_reads")) p->settle_reads = d >= 1 ? d : 1;
+      else if(!strcmp(name, "settle_time")) p->settle_time = d;
+      else if(!strcmp(name, "loopback")) p->loopback = d != 0;
+      else if(!strcmp(name, "batched_ok")) p->batched_ok = d != 0;
+      else if(!strcmp(name, "tx_rate")) p->tx_rate = d;
+      else if(!strcmp(name, "per_bit_rate")) p->per_bit_rate = d;
+      else if(!strcmp(name, "batched_rate")) p->batched_rate = d;
+    }
+  }
+  fclose(f);
+
+  p->timing.tx = p->tx.mean;
+  p->timing.rx = p->rx.mean;
+  p->timing.txrx = p->txrx.mean;
+  p->timing.sleep = p->sleep[0].mean;
+  p->timing.settle_reads = p->settle_reads;
+  return AVRPROG_OK;
+}
+
+void avrprog_set_profile(avrprog_t *ap, const struct avrprog_profile *p)
+{
+  ap->transport = p->transport == AVRPROG_BATCHED ? AVRPROG_BATCHED : AVRPROG_PER_BIT;
+  ap->settle_reads = p->settle_reads > 0 ? p->settle_reads : 1;
+}
+
+/* Production-line mode: the image, fuse and lock bytes are loaded once,
+ * then boards are detected, programmed and reported in a loop. */
+
+#define PRODUCTION_PROBE_INTERVAL 250000 /* us between probes */
+#define PRODUCTION_DEBOUNCE 2 /* identical probes to accept a change */
+
+/* The ISP frames of every page are prepared once, by compiling the
+ * image for the part of the first board or from a compiled image. */
+struct avrprog_job
+{
+  const unsigned char *flash;
+  int length;
+  int fuse_hi, fuse_lo;
+  int lock;
+
+  bool prepared;
+  unsigned char signature[3];
+  const struct avr_classic_part *classic;
+  const struct avrprog_image *img;
+  struct avrprog_image image; /* compiled into buf */
+  unsigned char *buf;
+};
+
+avrprog_job_t *avrprog_job_new(const unsigned char *flash, int length, int fuse_hi, int fuse_lo, int lock)
+{
+  avrprog_job_t *job;
+
+  job = calloc(1, sizeof(*job));
+  if(!job) return NULL;
+  job->flash = flash;
+  job->length = length;
+  job->fuse_hi = fuse_hi;
+  job->fuse_lo = fuse_lo;
+  job->lock = lock;
+  return job;
+}
+
+avrprog_job_t *avrprog_job_new_image(const struct avrprog_image *img, int fuse_hi, int fuse_lo, int lock)
+{
+  avrprog_job_t *job;
+
+  job = avrprog_job_new(img->data, img->length, fuse_hi, fuse_lo, lock);
+  if(!job) return NULL;
+  memcpy(job->signature, img->signature, 3);
+  job->classic = avr_classic_part_find(img->signature);
+  job->img = img;
+  job->prepared = true;
+  return job;
+}
+
+void avrprog_job_free(avrprog_job_t *job)
+{
+  if(!job) return;
+  free(job->buf);
+  free(job);
+}
+
+/* Quiet powerup, programming enable and signature read. */
+static int production_probe(avrprog_t *ap, unsigned char *sig)
+{
+  int i;
+
+  avr_reset_sequence(ap);
+  if(!avr_try_programming_enable(ap, 2)) return 0;
+  for(i = 0; i < 3; i++) sig[i] = avr_read_signature(ap, i);
+  return sig[0] == 0x1e;
+}
+
+int avrprog_wait_board(avrprog_t *ap, bool present, unsigned char *sig)
+{
+  unsigned char s[3];
+  int n;
+
+  n = 0;
+  for(;;) {
+    if((production_probe(ap, s) != 0) == present && (!present || !n || !memcmp(s, sig, 3))) {
+      if(present) memcpy(sig, s, 3);
+      if(++n == PRODUCTION_DEBOUNCE) return avr_status(ap, AVRPROG_OK);
+    } else n = 0;
+    if(ap->io_error) return avr_status(ap, AVRPROG_OK);
+    udelay(ap, PRODUCTION_PROBE_INTERVAL);
+  }
+}
+
+static int production_prepare(avrprog_t *ap, avrprog_job_t *job, const unsigned char *sig)
+{
+  int size;
+  int status;
+
+  if(job->prepared) {
+    if(memcmp(sig, job->signature, 3)) {
+      avr_error(ap, "ERROR: Signature does not match job (%02x %02x %02x).\n",
+          job->signature[0], job->signature[1], job->signature[2]);
+      return AVRPROG_ERR_PART;
+    }
+    return AVRPROG_OK;
+  }
+
+  status = image_build(ap, job->flash, job->length, sig, true, &job->buf, &size);
+  if(status) return status;
+  status = image_parse(ap, "job", job->buf, size, &job->image);
+  if(status) return status;
+  job->classic = avr_classic_part_find(sig);
+  job->img = &job->image;
+  memcpy(job->signature, sig, 3);
+  job->prepared = true;
+  return AVRPROG_OK;
+}
+
+int avrprog_job_run(avrprog_t *ap, avrprog_job_t *job, const unsigned char *sig)
+{
+  unsigned char f_hi, f_lo;
+  int status;
+
+  status = production_prepare(ap, job, sig);
+  if(status) return status;
+
+  avr_chip_erase_wait(ap, job->classic ? ERASE_TIME_CLASSIC : ERASE_TIME_MEGA);
+  avr_reset_sequence(ap);
+  if(!avr_try_programming_enable(ap, 10)) {
+    avr_error(ap, "ERROR: Lost chip after erase.\n");
+    return avr_status(ap, AVRPROG_ERR_NO_CHIP);
+  }
+
+  if(job->classic) {
+    status = avr_program_classic(ap, job->classic, job->img->data, job->img->length, true);
+  } else {
+    status = avr_program_mega(ap, job->img->data, job->img->length, job->img->page_size / 2, NULL, NULL, job->img);
+  }
+  if(status) return status;
+
+  if(job->fuse_hi >= 0) {
+    avrprog_write_fuses(ap, job->fuse_hi, job->fuse_lo);
+    avrprog_read_fuses(ap, &f_hi, &f_lo);
+    if(f_hi != job->fuse_hi || f_lo != job->fuse_lo) {
+      avr_error(ap, "ERROR: Fuse bytes read back as hi=0x%02x lo=0x%02x\n", f_hi, f_lo);
+      return avr_status(ap, AVRPROG_ERR_FUSE);
+    }
+  }
+  if(job->lock >= 0) avrprog_write_lock(ap, job->lock);
+  return avr_status(ap, AVRPROG_OK);
+}
+
+int avrprog_ihex_load(avrprog_t *ap, const char *fn, unsigned char *flash, int m)
+{
+  unsigned int x;
+  int n;
+  int i;
+  FILE *f;
+  char line[512];
+  unsigned char bytes[256];
+  int n_bytes;
+  int len;
+  unsigned char sum;
+  int addr;
+
+  f = fopen(fn, "r");
+  if(!f) {
+    avr_error(ap, "intelhex_load: can't open %s\n", fn);
+    return AVRPROG_ERR_FILE;
+  }
+
+  n = 0;
+  for(;;) {
+    if(fgets(line, sizeof(line), f)) {
+      if(line[0] == ':') {
+        for(n_bytes = 0, i = 1; isxdigit(line[i]) && isxdigit(line[i + 1]); i += 2) {
+          if(1 == sscanf(line + i, "%02x", &x)) {
+            bytes[n_bytes++] = x;
+          } else {
+            n = AVRPROG_ERR_FILE;
+            avr_error(ap, "intelhex_load: file %s: bad line\n", fn);
+            goto bye;
+          }
+        }
+        if(n_bytes >= 2) {
+          len = bytes[0];
+          if(len + 5 != n_bytes) {
+            avr_error(ap, "intelhex_load: bad record length\n");
+            n = AVRPROG_ERR_FILE;
+            goto bye;
+          }
+          sum = 0;
+          for(i = 0; i < n_bytes; i++) {
+            sum += bytes[i];
+          }
+          if(sum) {
+            avr_error(ap, "intelhex_load: checksum error, got 0x%02x\n", sum);
+            n = AVRPROG_ERR_FILE;
+            goto bye;
+          }
+
+          switch(bytes[3]) {
+            case 0x00: /* data */
+              if(len >= 0) {
+                addr = (bytes[1] << 8) | bytes[2];
+                if(0 <= addr && addr + len <= m) {
+                  for(i = 0; i < len; i++) {
+                    flash[addr + i] = bytes[4+i];
+                  }
+                  if(addr + len > n) n = addr + len;
+                } else {
+                  avr_error(ap, "intelhex_load: address 0x%02x out of range\n", addr);
+                }
+              } else avr_error(ap, "intelhex_load: short data record\n");
+              break;
+            case 0x01: /* eof */
+              goto bye;
+            default:
+              avr_error(ap, "intelhex_load: unknown record type 0x%02x, ignoring\n", bytes[0]);
+              break;
+          }
+        }
+      } else {
+        avr_error(ap, "intelhex_load: ignoring line\n");
+      }
+    } else break;
+  }
+
+bye:
+  fclose(f);
+  return n;
+}
@@ -0,0 +1,216 @@
+/* Atmel AVR programmer library
+ * Copyright (C)2004-2010 Berke Durak
+ * Released in the public domain.
+ *
+ * All state lives in an avrprog_t; separate contexts (one per comedi
+ * device) can be used from separate threads.  Functions returning int
+ * return AVRPROG_OK or a negative avrprog_status unless noted.
+ * Messages and progress are reported through callbacks. */
+
+#ifndef LIBAVRPROG_H
+#define LIBAVRPROG_H
+
+#include <stdbool.h>
+
+typedef struct avrprog avrprog_t;
+
+enum avrprog_status
+{
+  AVRPROG_OK          =   0,
+  AVRPROG_ERR_DEVICE  =  -1, /* comedi device can't be opened or accessed */
+  AVRPROG_ERR_NO_CHIP =  -2, /* programming enable not acknowledged */
+  AVRPROG_ERR_PART    =  -3, /* unknown part, or not the one expected */
+  AVRPROG_ERR_SIZE    =  -4, /* image larger than the flash */
+  AVRPROG_ERR_WRITE   =  -5, /* write not completed in time */
+  AVRPROG_ERR_VERIFY  =  -6, /* flash does not read back as written */
+  AVRPROG_ERR_FUSE    =  -7, /* fuse bytes do not read back as written */
+  AVRPROG_ERR_FILE    =  -8, /* can't read or parse a file */
+  AVRPROG_ERR_STUB    =  -9, /* stub loader protocol failure */
+  AVRPROG_ERR_NACK    = -10, /* prototran command not acknowledged */
+};
+
+enum avrprog_level
+{
+  AVRPROG_INFO,
+  AVRPROG_ERROR,
+};
+
+enum avrprog_phase
+{
+  AVRPROG_PHASE_PROGRAM,
+  AVRPROG_PHASE_VERIFY,
+  AVRPROG_PHASE_STREAM,
+};
+
+/* msg is printed as is; it usually ends with a newline */
+typedef void avrprog_message_fn(void *user, enum avrprog_level level, const char *msg);
+typedef void avrprog_progress_fn(void *user, enum avrprog_phase phase, int done, int total);
+
+avrprog_t *avrprog_open(const char *device, int subdevice, int *status);
+void avrprog_close(avrprog_t *ap);
+const char *avrprog_strerror(int status);
+
+void avrprog_set_callbacks(avrprog_t *ap, avrprog_message_fn *message, avrprog_progress_fn *progress, void *user);
+void avrprog_set_slow(avrprog_t *ap, bool slow);
+/* journal is the file megaprogram records its progress in, NULL (the
+ * default) for none; with resume a matching journal is used to continue
+ * an interrupted run, and the chip is erased if there is none */
+void avrprog_set_journal(avrprog_t *ap, const char *journal, bool resume);
+
+/* Raw line access */
+int avrprog_set_lines(avrprog_t *ap, unsigned bits); /* AVRPROG_MOSI|AVRPROG_SCLK|AVRPROG_RST */
+int avrprog_read_miso(avrprog_t *ap, bool *miso);
+int avrprog_prototran(avrprog_t *ap, int tau, unsigned long x);
+
+#define AVRPROG_MOSI (1 << 0)
+#define AVRPROG_SCLK (1 << 1)
+#define AVRPROG_RST  (1 << 2)
+
+/* Target operations; all but avrprog_powerup() expect the target to be
+ * in programming mode. */
+int avrprog_powerup(avrprog_t *ap);
+int avrprog_erase(avrprog_t *ap);
+int avrprog_unlock(avrprog_t *ap);
+int avrprog_read_signature(avrprog_t *ap, unsigned char *sig);
+int avrprog_read_fuses(avrprog_t *ap, unsigned char *f_hi, unsigned char *f_lo);
+int avrprog_write_fuses(avrprog_t *ap, unsigned char f_hi, unsigned char f_lo);
+int avrprog_read_lock(avrprog_t *ap, unsigned char *lock);
+int avrprog_write_lock(avrprog_t *ap, unsigned char lock);
+int avrprog_read_flash(avrprog_t *ap, int addr, int length, unsigned char *buf);
+/* *errors (if not NULL) gets the number of mismatching words */
+int avrprog_verify(avrprog_t *ap, const unsigned char *flash, int addr, int length, int *errors);
+
+/* Classic (AT90S) parts, assumes an erased chip */
+int avrprog_program_classic(avrprog_t *ap, const unsigned char *flash, int length, bool verify);
+/* Paged (ATmega) parts, journaled if a journal is set */
+int avrprog_program_mega(avrprog_t *ap, const unsigned char *flash, int length);
+/* Erase, ISP-program the stub loader, then stream the image through it */
+int avrprog_stub_program(avrprog_t *ap, const unsigned char *stub, int stub_length,
+    const unsigned char *flash, int length);
+
+/* Compiled images: a memory-mapped container holding the image as whole
+ * pages for one part, with a bitmap of non-blank pages, a hash of each
+ * page and optionally the ISP frames that load and write each page.
+ * See libavrprog.c for the layout. */
+struct avrprog_image
+{
+  unsigned char signature[3];
+  int length;                   /* bytes in the original image */
+  int page_size;                /* bytes */
+  int pages;
+  unsigned long hash;           /* avrprog_hash() of the first length bytes */
+  const unsigned char *bitmap;  /* bit j set if page j is not blank */
+  const unsigned char *hashes;  /* 32-bit LE avrprog_hash() per page */
+  const unsigned char *data;    /* pages * page_size bytes */
+  const unsigned char *frames;  /* NULL, or frame_size bytes per page */
+  int frame_size;
+
+  void *map;
+  unsigned long map_size;
+};
+
+int avrprog_image_compile(avrprog_t *ap, const unsigned char *flash, int length,
+    const unsigned char *sig, bool frames, const char *fn);
+bool avrprog_image_probe(const char *fn); /* true if fn is a compiled image */
+int avrprog_image_open(avrprog_t *ap, const char *fn, struct avrprog_image *img);
+void avrprog_image_close(struct avrprog_image *img);
+bool avrprog_image_populated(const struct avrprog_image *img, int j);
+unsigned long avrprog_image_page_hash(const struct avrprog_image *img, int j);
+/* AVRPROG_ERR_PART unless the target has the image's signature */
+int avrprog_image_check(avrprog_t *ap, const struct avrprog_image *img);
+/* Program (classic or paged, as for the raw functions above) after
+ * checking the target signature */
+int avrprog_program_image(avrprog_t *ap, const struct avrprog_image *img);
+/* Compare page hashes after checking the target signature; *errors
+ * gets the number of mismatching pages */
+int avrprog_verify_image(avrprog_t *ap, const struct avrprog_image *img, int *errors);
+
+/* Cost model.  Per-call latencies of the DIO backend, in us: tx() and
+ * rx_miso() as used bit by bit, a single comedi_dio_bitfield2() call
+ * writing the outputs and reading the inputs, and the overshoot of a
+ * short udelay(). */
+struct avrprog_timing
+{
+  double tx, rx, txrx, sleep;
+  int settle_reads;  /* MISO reads per line update, per-bit */
+};
+
+enum avrprog_transport
+{
+  AVRPROG_PER_BIT,   /* one write and one read per line update */
+  AVRPROG_BATCHED,   /* one combined write/read per line update */
+  AVRPROG_STREAMED,  /* packed through the stub loader, stub not included */
+};
+
+struct avrprog_estimate
+{
+  long long wire_bits;             /* clocked on SCK */
+  long instructions;               /* 4-byte ISP instructions */
+  long polls;                      /* readbacks waiting for writes */
+  double poll_wait, erase_wait;    /* us idle */
+  double program_time, verify_time; /* us, program includes poll_wait */
+  int pages, pages_written;        /* paged parts */
+  int bytes_written;               /* classic parts */
+};
+
+int avrprog_measure_timing(avrprog_t *ap, struct avrprog_timing *t);
+/* Doesn't access the target; AVRPROG_ERR_PART if the transport doesn't
+ * apply to the part.  AVRPROG_STREAMED includes the ISP upload of the
+ * stub loader and fails with AVRPROG_ERR_STUB if stub is NULL. */
+int avrprog_estimate(avrprog_t *ap, const struct avrprog_timing *t, enum avrprog_transport transport,
+    const unsigned char *sig, const unsigned char *flash, int length,
+    const unsigned char *stub, int stub_length, struct avrprog_estimate *e);
+
+/* Link characterization, see avrprog_characterize().  Times in us,
+ * rates in line updates per second. */
+struct avrprog_stats
+{
+  double mean, min, median, p99, max;
+};
+
+struct avrprog_profile
+{
+  struct avrprog_stats tx, rx, txrx;  /* per call */
+  struct avrprog_stats sleep[3];      /* udelay() 10, 100, 1000 us overshoot */
+  double tx_rate, per_bit_rate, batched_rate;
+  bool loopback;         /* RST was seen on MISO */
+  bool batched_ok;       /* a combined call reads back its own write */
+  int settle_reads;      /* MISO reads until a write shows */
+  double settle_time;
+
+  enum avrprog_transport transport; /* best safe transport */
+  struct avrprog_timing timing;     /* for avrprog_estimate() */
+};
+
+/* Needs RST wired to MISO and no target for the settling measurement */
+int avrprog_characterize(avrprog_t *ap, struct avrprog_profile *p);
+int avrprog_profile_save(avrprog_t *ap, const struct avrprog_profile *p, const char *fn);
+int avrprog_profile_load(avrprog_t *ap, const char *fn, struct avrprog_profile *p);
+/* Use the profile's transport and MISO settling */
+void avrprog_set_profile(avrprog_t *ap, const struct avrprog_profile *p);
+
+/* Production jobs: a preloaded image with fuse and lock bytes (-1 to
+ * leave alone).  The ISP frames are prepared once, for the part of the
+ * first board the job runs on, or taken from a compiled image.  flash
+ * and img are not copied. */
+typedef struct avrprog_job avrprog_job_t;
+
+avrprog_job_t *avrprog_job_new(const unsigned char *flash, int length, int fuse_hi, int fuse_lo, int lock);
+avrprog_job_t *avrprog_job_new_image(const struct avrprog_image *img, int fuse_hi, int fuse_lo, int lock);
+void avrprog_job_free(avrprog_job_t *job);
+
+/* Blocks until a board is present (or absent).  When waiting for a
+ * board sig gets its signature; when waiting for removal sig is not
+ * touched and may be NULL. */
+int avrprog_wait_board(avrprog_t *ap, bool present, unsigned char *sig);
+/* Erase, program, verify, fuses and lock for the board with signature sig */
+int avrprog_job_run(avrprog_t *ap, avrprog_job_t *job, const unsigned char *sig);
+
+/* Images; these don't touch the hardware and accept ap == NULL */
+int avrprog_ihex_load(avrprog_t *ap, const char *fn, unsigned char *flash, int m); /* length or status */
+int avrprog_pack(const unsigned char *in, int n, unsigned char *out); /* out: n + n / 32 + 4 bytes */
+int avrprog_unpack(const unsigned char *in, int n, unsigned char *out, int m); /* length or -1 */
+unsigned short avrprog_crc16(unsigned short crc, const unsigned char *p, int n);
+unsigned long avrprog_hash(const unsigned char *p, int n); /* 32-bit FNV-1a */
+
+#endif